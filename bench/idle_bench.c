@@ -0,0 +1,164 @@
+#define SOCKLET_IMPLEMENTATION
+
+#include "../socklet.h"
+
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#define PORT 8091
+#define WARMUP 256
+#define CONNECTIONS 10000
+#define BUDGET 4096
+
+static const char *handshake =
+    "GET / HTTP/1.1\r\n"
+    "Host: 127.0.0.1\r\n"
+    "Upgrade: websocket\r\n"
+    "Connection: Upgrade\r\n"
+    "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+    "Sec-WebSocket-Version: 13\r\n\r\n";
+
+static void on_connect(int client_fd, char *headers, client_t *client)
+{
+    (void)client_fd;
+    (void)headers;
+    (void)client;
+}
+
+static bool on_authenticate(int client_fd, char *headers)
+{
+    (void)client_fd;
+    (void)headers;
+    return true;
+}
+
+static long resident_bytes(pid_t pid)
+{
+    char path[64];
+    char line[256];
+    long kilobytes = -1;
+
+    snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+    FILE *status = fopen(path, "r");
+    if (!status)
+        return -1;
+    while (fgets(line, sizeof(line), status))
+    {
+        if (sscanf(line, "VmRSS: %ld kB", &kilobytes) == 1)
+            break;
+    }
+    fclose(status);
+    return kilobytes * 1024;
+}
+
+static int open_connection(void)
+{
+    struct sockaddr_in address = {0};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(PORT);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    if (connect(fd, (struct sockaddr *)&address, sizeof(address)) != 0 ||
+        send(fd, handshake, strlen(handshake), 0) != (ssize_t)strlen(handshake))
+    {
+        close(fd);
+        return -1;
+    }
+
+    // Wait for the 101 so the connection is open, not still handshaking.
+    char response[512];
+    size_t length = 0;
+    while (length < sizeof(response) - 1)
+    {
+        ssize_t received = recv(fd, response + length, sizeof(response) - 1 - length, 0);
+        if (received <= 0)
+        {
+            close(fd);
+            return -1;
+        }
+        length += received;
+        response[length] = '\0';
+        if (strstr(response, "\r\n\r\n"))
+            return fd;
+    }
+    close(fd);
+    return -1;
+}
+
+static int open_connections(int *fds, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        if ((fds[i] = open_connection()) < 0)
+            return i;
+    }
+    return count;
+}
+
+int main(int argc, char **argv)
+{
+    int connections = argc > 1 ? atoi(argv[1]) : CONNECTIONS;
+
+    // Both ends live on this host, so each connection costs two descriptors.
+    struct rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+    if ((rlim_t)(connections + WARMUP + 64) > limit.rlim_cur)
+        connections = (int)limit.rlim_cur - WARMUP - 64;
+
+    pid_t server_pid = fork();
+    if (server_pid == 0)
+    {
+        if (!freopen("/dev/null", "w", stdout) || !freopen("/dev/null", "w", stderr))
+            return 1;
+        server_t server;
+        server_init(&server, on_connect, on_authenticate);
+        server_listen(&server, PORT);
+        return 0;
+    }
+
+    int *fds = malloc(sizeof(int) * (connections + WARMUP));
+    int fd = -1;
+    for (int attempt = 0; attempt < 100 && fd < 0; attempt++)
+    {
+        usleep(20000);
+        fd = open_connection();
+    }
+    if (fd < 0 || !fds)
+    {
+        fprintf(stderr, "server did not come up on port %d\n", PORT);
+        kill(server_pid, SIGKILL);
+        return 1;
+    }
+    close(fd);
+
+    // Warm up the loops, their buffer pools and the allocator arenas first so
+    // the measurement only covers what each further connection adds.
+    int warm = open_connections(fds, WARMUP);
+    usleep(200000);
+    long before = resident_bytes(server_pid);
+
+    int opened = open_connections(fds + warm, connections);
+    usleep(500000);
+    long after = resident_bytes(server_pid);
+
+    double per_connection = opened > 0 ? (double)(after - before) / opened : 0;
+    printf("Idle connections: %d open, server RSS %.1f MB -> %.1f MB\n", opened, before / 1048576.0, after / 1048576.0);
+    printf("Memory per idle connection: %.0f bytes (budget %d) %s\n", per_connection, BUDGET,
+           opened == connections && per_connection <= BUDGET ? "PASS" : "FAIL");
+
+    for (int i = 0; i < warm + opened; i++)
+    {
+        close(fds[i]);
+    }
+    free(fds);
+    kill(server_pid, SIGKILL);
+    waitpid(server_pid, NULL, 0);
+
+    return opened == connections && per_connection <= BUDGET ? 0 : 1;
+}
@@ -0,0 +1,372 @@
+#define SOCKLET_IMPLEMENTATION
+
+#include "../socklet.h"
+
+// Runs each kernel in a calibrated loop and prints one JSON document, so two
+// runs can be compared with diff or jq. Pass a substring to run a subset.
+
+#define TARGET_NS 100000000ULL
+#define REPEATS 5
+#define MANY_EVENTS 200
+
+#define MICROBENCH_RESULT_FIELDS(FIELD, ARG) \
+    FIELD(ARG, name, JSON_STRING, 64, true) \
+    FIELD(ARG, bytes, JSON_INT, 0, true) \
+    FIELD(ARG, iterations, JSON_INT, 0, true) \
+    FIELD(ARG, ns_per_op, JSON_DOUBLE, 0, true) \
+    FIELD(ARG, bytes_per_sec, JSON_DOUBLE, 0, true)
+
+JSON_SCHEMA(microbench_result_t, microbench_result, MICROBENCH_RESULT_FIELDS)
+
+typedef void (*kernel_t)(void *context);
+
+static const char *filter = NULL;
+static JsonWriter output;
+static bool first_result = true;
+static volatile size_t sink;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t time_loop(kernel_t kernel, void *context, uint64_t iterations)
+{
+    uint64_t started = now_ns();
+    for (uint64_t i = 0; i < iterations; i++)
+    {
+        kernel(context);
+    }
+    return now_ns() - started;
+}
+
+// Doubles the iteration count until one loop takes a tenth of the target,
+// then reports the fastest of REPEATS full-length loops.
+static void measure(const char *name, size_t bytes, kernel_t kernel, void *context)
+{
+    if (filter && !strstr(name, filter))
+        return;
+
+    uint64_t iterations = 1;
+    while (time_loop(kernel, context, iterations) < TARGET_NS / 10 && iterations < (1ULL << 30))
+    {
+        iterations *= 2;
+    }
+    iterations *= 10;
+    if (iterations > INT32_MAX)
+        iterations = INT32_MAX;
+
+    uint64_t best = UINT64_MAX;
+    for (int repeat = 0; repeat < REPEATS; repeat++)
+    {
+        uint64_t elapsed = time_loop(kernel, context, iterations);
+        if (elapsed < best)
+            best = elapsed;
+    }
+
+    microbench_result_t result = {0};
+    snprintf(result.name, sizeof(result.name), "%s", name);
+    result.bytes = (int)bytes;
+    result.iterations = (int)iterations;
+    result.ns_per_op = (double)best / iterations;
+    result.bytes_per_sec = bytes ? bytes * 1e9 / result.ns_per_op : 0;
+
+    char *error = NULL;
+    json_write_raw(&output, first_result ? "\n    " : ",\n    ", first_result ? 5 : 6);
+    if (!microbench_result_serialize(&output, &result, &error))
+        fprintf(stderr, "%s: %s\n", name, error);
+    first_result = false;
+
+    fprintf(stderr, "%-36s %12.1f ns/op", name, result.ns_per_op);
+    if (bytes)
+        fprintf(stderr, " %10.1f MB/s", result.bytes_per_sec / (1024 * 1024));
+    fprintf(stderr, "\n");
+}
+
+// decode_frame
+
+typedef struct
+{
+    unsigned char *frame;
+    size_t frame_length;
+    char *output;
+} decode_context_t;
+
+static void fill_text(unsigned char *payload, size_t length)
+{
+    const char *pattern = "{\"type\":\"socklet:dispatch\",\"event\":\"chat\",\"data\":\"caf\xc3\xa9 \xe6\x97\xa5\"} ";
+    size_t pattern_length = strlen(pattern);
+    size_t i = 0;
+    while (i + pattern_length <= length)
+    {
+        memcpy(payload + i, pattern, pattern_length);
+        i += pattern_length;
+    }
+    memset(payload + i, ' ', length - i);
+}
+
+static void decode_setup(decode_context_t *context, unsigned char opcode, size_t length)
+{
+    const unsigned char mask[4] = {0x12, 0x34, 0x56, 0x78};
+
+    context->frame = malloc(length + 14);
+    context->output = malloc(length);
+    size_t header_length = encode_frame_header(context->frame, opcode, length);
+    context->frame[1] |= 0x80;
+    memcpy(context->frame + header_length, mask, 4);
+
+    unsigned char *payload = context->frame + header_length + 4;
+    fill_text(payload, length);
+    unmask_payload(payload, length, mask, 0);
+    context->frame_length = header_length + 4 + length;
+}
+
+static void decode_kernel(void *arg)
+{
+    decode_context_t *context = (decode_context_t *)arg;
+    size_t output_length = 0;
+    decode_frame(context->frame, context->frame_length, context->output, &output_length);
+    sink += output_length;
+}
+
+static void bench_decode_frame(void)
+{
+    static const size_t sizes[] = {16, 125, 1024, 16384, 65536};
+
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+    {
+        for (unsigned char opcode = 0x1; opcode <= 0x2; opcode++)
+        {
+            char name[64];
+            decode_context_t context;
+            decode_setup(&context, opcode, sizes[i]);
+            snprintf(name, sizeof(name), "decode_frame/%s/%zu", opcode == 0x1 ? "text" : "binary", sizes[i]);
+            measure(name, sizes[i], decode_kernel, &context);
+            free(context.frame);
+            free(context.output);
+        }
+    }
+}
+
+// Framing
+
+static void header_kernel(void *arg)
+{
+    unsigned char header[10];
+    sink += encode_frame_header(header, 0x1, *(size_t *)arg);
+}
+
+typedef struct
+{
+    int fd;
+    char *message;
+} send_context_t;
+
+static void *drain_thread(void *arg)
+{
+    int fd = *(int *)arg;
+    char buffer[65536];
+    while (read(fd, buffer, sizeof(buffer)) > 0)
+    {
+    }
+    return NULL;
+}
+
+static void send_kernel(void *arg)
+{
+    send_context_t *context = (send_context_t *)arg;
+    send_frame(context->fd, context->message);
+}
+
+static void bench_framing(void)
+{
+    static const size_t lengths[] = {100, 1000, 100000};
+    static const char *forms[] = {"7bit", "16bit", "64bit"};
+
+    for (size_t i = 0; i < 3; i++)
+    {
+        char name[64];
+        size_t length = lengths[i];
+        snprintf(name, sizeof(name), "frame_header/%s", forms[i]);
+        measure(name, 0, header_kernel, &length);
+    }
+
+    // send_frame() into a socket pair whose other end is drained by a thread.
+    // The descriptor belongs to no client, so this times the lookup under
+    // client_lock and the single sendmsg() of header and payload, not the
+    // per-client output queue.
+    int pair[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) != 0)
+    {
+        perror("socketpair");
+        return;
+    }
+    pthread_t drain;
+    pthread_create(&drain, NULL, drain_thread, &pair[1]);
+
+    static const size_t sizes[] = {64, 1024, 16384};
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+    {
+        char name[64];
+        send_context_t context = {pair[0], malloc(sizes[i] + 1)};
+        fill_text((unsigned char *)context.message, sizes[i]);
+        context.message[sizes[i]] = '\0';
+        snprintf(name, sizeof(name), "send_frame/%zu", sizes[i]);
+        measure(name, sizes[i], send_kernel, &context);
+        free(context.message);
+    }
+
+    close(pair[0]);
+    pthread_join(drain, NULL);
+    close(pair[1]);
+}
+
+// Handshake
+
+static void accept_key_kernel(void *arg)
+{
+    char accept_key[64];
+    compute_websocket_accept_key((const char *)arg, accept_key);
+    sink += accept_key[0];
+}
+
+// JSON
+
+static const char *envelope_json =
+    "{\"type\":\"socklet:dispatch\",\"event\":\"sendMessage\",\"data\":\"hello from the benchmark\"}";
+
+static const char *nested_json =
+    "{\"id\":42,\"player\":{\"name\":\"mysticastra\",\"level\":17,\"online\":true,"
+    "\"position\":{\"x\":12.5,\"y\":-3.25,\"z\":0.5}},\"scores\":[10,20,30,40],\"note\":\"ok\"}";
+
+static void envelope_schema_kernel(void *arg)
+{
+    (void)arg;
+    dispatch_envelope_t envelope;
+    char *error = NULL;
+    sink += dispatch_envelope_parse(envelope_json, &envelope, &error);
+}
+
+static void envelope_table_kernel(void *arg)
+{
+    (void)arg;
+    dispatch_envelope_t envelope;
+    JsonMap mappings[dispatch_envelope_field_count];
+    char *error = NULL;
+    dispatch_envelope_bind(&envelope, mappings);
+    sink += parse_json(envelope_json, mappings, dispatch_envelope_field_count, &error);
+}
+
+static void nested_kernel(void *arg)
+{
+    (void)arg;
+    int id = 0, level = 0, scores[4];
+    bool online = false;
+    double x = 0, y = 0, z = 0;
+    char name[32], note[16];
+    char *error = NULL;
+
+    JsonMap position[] = {
+        {"x", &x, 'd', 0, true, NULL},
+        {"y", &y, 'd', 0, true, NULL},
+        {"z", &z, 'd', 0, false, NULL},
+    };
+    JsonMap player[] = {
+        {"name", name, 's', sizeof(name), true, NULL},
+        {"level", &level, 'i', 0, true, NULL},
+        {"online", &online, 'b', 0, false, NULL},
+        {"position", NULL, 'o', 3, true, position},
+    };
+    JsonMap score = {"score", NULL, 'i', 0, true, NULL};
+    JsonMap mappings[] = {
+        {"id", &id, 'i', 0, true, NULL},
+        {"player", NULL, 'o', 4, true, player},
+        {"scores", scores, 'a', 4, true, &score},
+        {"note", note, 's', sizeof(note), false, NULL},
+    };
+
+    sink += parse_json(nested_json, mappings, 4, &error);
+}
+
+// Events
+
+static void noop_event(client_t *client, void *data)
+{
+    (void)client;
+    sink += (size_t)data;
+}
+
+static bool pass_middleware(middleware_context_t *context, void *arg)
+{
+    (void)arg;
+    return context->data != NULL;
+}
+
+static void emit_kernel(void *arg)
+{
+    emit_event((const char *)arg, NULL, arg);
+}
+
+static void handle_kernel(void *arg)
+{
+    handle_event(NULL, arg);
+}
+
+static void bench_events(void)
+{
+    static char names[MANY_EVENTS][24];
+
+    for (int i = 0; i < MANY_EVENTS; i++)
+    {
+        snprintf(names[i], sizeof(names[i]), "event%d", i);
+        register_event(names[i], noop_event);
+    }
+
+    char name[64];
+    snprintf(name, sizeof(name), "emit_event/%d/first", MANY_EVENTS);
+    measure(name, 0, emit_kernel, names[0]);
+    snprintf(name, sizeof(name), "emit_event/%d/last", MANY_EVENTS);
+    measure(name, 0, emit_kernel, names[MANY_EVENTS - 1]);
+    snprintf(name, sizeof(name), "emit_event/%d/missing", MANY_EVENTS);
+    measure(name, 0, emit_kernel, "notRegistered");
+
+    // One global and two event-specific middleware on the first event.
+    use_middleware(pass_middleware, NULL);
+    use_event_middleware(names[0], pass_middleware, NULL);
+    use_event_middleware(names[0], pass_middleware, NULL);
+    snprintf(name, sizeof(name), "emit_event/%d/middleware3", MANY_EVENTS);
+    measure(name, 0, emit_kernel, names[0]);
+
+    char message[128];
+    snprintf(message, sizeof(message), "{\"type\":\"socklet:dispatch\",\"event\":\"%s\",\"data\":\"hello\"}", names[MANY_EVENTS / 2]);
+    snprintf(name, sizeof(name), "handle_event/%d", MANY_EVENTS);
+    measure(name, strlen(message), handle_kernel, message);
+}
+
+int main(int argc, char **argv)
+{
+    static char buffer[1 << 16];
+    filter = argc > 1 ? argv[1] : NULL;
+
+    json_writer_init(&output, buffer, sizeof(buffer), 0);
+    json_write_raw(&output, "{\n  \"results\": [", 16);
+
+    bench_decode_frame();
+    bench_framing();
+    measure("compute_websocket_accept_key", 0, accept_key_kernel, "dGhlIHNhbXBsZSBub25jZQ==");
+    measure("parse_json/envelope/schema", strlen(envelope_json), envelope_schema_kernel, NULL);
+    measure("parse_json/envelope/table", strlen(envelope_json), envelope_table_kernel, NULL);
+    measure("parse_json/nested", strlen(nested_json), nested_kernel, NULL);
+    bench_events();
+
+    json_write_raw(&output, "\n  ]\n}\n", 7);
+    if (output.overflow)
+    {
+        fprintf(stderr, "microbench: output buffer too small\n");
+        return 1;
+    }
+    fwrite(json_writer_data(&output), 1, output.length, stdout);
+    return 0;
+}
@@ -0,0 +1,501 @@
+#define SOCKLET_IMPLEMENTATION
+
+#include "../socklet.h"
+
+#include <getopt.h>
+#include <netdb.h>
+#include <netinet/tcp.h>
+
+// Replays a traffic log written by server_set_recorder() against a running
+// server. Every recorded connection gets its own WebSocket connection, and
+// every message is followed by a ping carrying its index. The server answers
+// pings in order after handling the message, so the pong gives the latency.
+
+#define MAX_HEADERS 16
+
+typedef struct
+{
+    uint64_t id;
+    int fd;
+    bool open;
+    atomic_bool closed;
+    unsigned char header[10];
+    uint8_t header_length;
+    uint8_t header_needed;
+    uint64_t remaining;
+    unsigned char opcode;
+    unsigned char pong[8];
+    uint8_t pong_length;
+} replay_connection_t;
+
+typedef struct
+{
+    replay_connection_t *slots;
+    size_t capacity;
+} connection_table_t;
+
+static const char *host = "127.0.0.1";
+static int port = 8081;
+static const char *headers[MAX_HEADERS];
+static int header_count = 0;
+static double speed = 1.0;
+
+static uint64_t *sent_at;
+static uint64_t *latency;
+static size_t message_count;
+static atomic_size_t pongs = 0;
+static atomic_size_t server_closed = 0;
+static atomic_bool sending_done = false;
+static int epoll_fd;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static replay_connection_t *connection_find(connection_table_t *table, uint64_t id)
+{
+    size_t index = (size_t)(id * 0x9E3779B97F4A7C15ULL) & (table->capacity - 1);
+    while (table->slots[index].open && table->slots[index].id != id)
+    {
+        index = (index + 1) & (table->capacity - 1);
+    }
+    return &table->slots[index];
+}
+
+// Server frames are unmasked. Only pongs are looked at; everything else is
+// skipped, possibly across several reads.
+static void connection_parse(replay_connection_t *connection, const unsigned char *data, size_t length)
+{
+    while (length > 0)
+    {
+        if (connection->header_length < connection->header_needed)
+        {
+            connection->header[connection->header_length++] = *data++;
+            length--;
+
+            if (connection->header_length == 2)
+            {
+                unsigned char short_length = connection->header[1] & 0x7F;
+                connection->header_needed = 2 + (short_length == 126 ? 2 : short_length == 127 ? 8 : 0);
+            }
+            if (connection->header_length < connection->header_needed)
+                continue;
+
+            unsigned char short_length = connection->header[1] & 0x7F;
+            uint64_t payload_length = short_length;
+            if (short_length >= 126)
+            {
+                payload_length = 0;
+                for (int i = 2; i < connection->header_needed; i++)
+                {
+                    payload_length = (payload_length << 8) | connection->header[i];
+                }
+            }
+            connection->opcode = connection->header[0] & 0x0F;
+            connection->remaining = payload_length;
+            connection->pong_length = 0;
+        }
+        else
+        {
+            size_t take = connection->remaining < length ? (size_t)connection->remaining : length;
+            if (connection->opcode == 0xA)
+            {
+                for (size_t i = 0; i < take && connection->pong_length < sizeof(connection->pong); i++)
+                {
+                    connection->pong[connection->pong_length++] = data[i];
+                }
+            }
+            connection->remaining -= take;
+            data += take;
+            length -= take;
+        }
+
+        if (connection->header_length == connection->header_needed && connection->remaining == 0)
+        {
+            if (connection->opcode == 0xA && connection->pong_length == sizeof(connection->pong))
+            {
+                // Pongs from the server echo whatever the ping carried, so
+                // only indices this run could have sent are counted.
+                uint64_t index;
+                memcpy(&index, connection->pong, sizeof(index));
+                if (index < message_count && sent_at[index])
+                {
+                    latency[index] = now_ns() - sent_at[index];
+                    atomic_fetch_add(&pongs, 1);
+                }
+            }
+            connection->header_length = 0;
+            connection->header_needed = 2;
+        }
+    }
+}
+
+static void *receive_thread(void *arg)
+{
+    size_t expected = *(size_t *)arg;
+    unsigned char buffer[65536];
+    struct epoll_event events[64];
+    uint64_t deadline = 0;
+
+    while (atomic_load(&pongs) < expected)
+    {
+        if (atomic_load(&sending_done))
+        {
+            if (deadline == 0)
+                deadline = now_ns() + 2000000000ULL;
+            else if (now_ns() > deadline)
+                break;
+        }
+
+        int count = epoll_wait(epoll_fd, events, 64, 50);
+        for (int i = 0; i < count; i++)
+        {
+            replay_connection_t *connection = (replay_connection_t *)events[i].data.ptr;
+            ssize_t received = recv(connection->fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+            if (received > 0)
+            {
+                connection_parse(connection, buffer, received);
+            }
+            else if (received == 0 || (errno != EAGAIN && errno != EINTR))
+            {
+                epoll_ctl(epoll_fd, EPOLL_CTL_DEL, connection->fd, NULL);
+                if (!atomic_load(&connection->closed))
+                    atomic_fetch_add(&server_closed, 1);
+            }
+        }
+    }
+    return NULL;
+}
+
+static int connection_open(replay_connection_t *connection)
+{
+    char port_string[16];
+    struct addrinfo hints = {0};
+    struct addrinfo *address;
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(port_string, sizeof(port_string), "%d", port);
+    if (getaddrinfo(host, port_string, &hints, &address) != 0)
+        return -1;
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, address->ai_addr, address->ai_addrlen) != 0)
+    {
+        freeaddrinfo(address);
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    freeaddrinfo(address);
+
+    int nodelay = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+    // Extra headers go first: the server cuts the request at the blank line,
+    // so the last header reaches the authentication handler without its CRLF.
+    char request[4096];
+    int length = snprintf(request, sizeof(request), "GET / HTTP/1.1\r\n");
+    for (int i = 0; i < header_count; i++)
+    {
+        length += snprintf(request + length, sizeof(request) - length, "%s\r\n", headers[i]);
+    }
+    length += snprintf(request + length, sizeof(request) - length,
+                       "Host: %s:%d\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+                       "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\nSec-WebSocket-Version: 13\r\n\r\n",
+                       host, port);
+
+    char response[4096];
+    size_t received = 0;
+    char *end = NULL;
+    if (send(fd, request, length, MSG_NOSIGNAL) != length)
+    {
+        close(fd);
+        return -1;
+    }
+    while (!end && received < sizeof(response) - 1)
+    {
+        ssize_t result = recv(fd, response + received, sizeof(response) - 1 - received, 0);
+        if (result <= 0)
+            break;
+        received += result;
+        response[received] = '\0';
+        end = strstr(response, "\r\n\r\n");
+    }
+    if (!end || strncmp(response, "HTTP/1.1 101", 12) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    connection->fd = fd;
+    connection->header_needed = 2;
+    // Frames that arrived with the response go through the parser before the
+    // receive thread can see the connection.
+    connection_parse(connection, (unsigned char *)end + 4, received - (end + 4 - response));
+
+    struct epoll_event event = {0};
+    event.events = EPOLLIN;
+    event.data.ptr = connection;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event);
+    return 0;
+}
+
+// Frames are sent with an all-zero mask so payloads go out straight from the
+// mapped log; the server unmasks them as usual.
+static int send_message(replay_connection_t *connection, const trace_record_t *record, uint64_t index)
+{
+    unsigned char header[14];
+    unsigned char ping[14] = {0x89, 0x80 | 8, 0, 0, 0, 0};
+    size_t header_length = encode_frame_header(header, record->kind, record->length);
+    header[1] |= 0x80;
+    memset(header + header_length, 0, 4);
+    memcpy(ping + 6, &index, sizeof(index));
+
+    struct iovec parts[3] = {
+        {header, header_length + 4},
+        {(void *)(record + 1), record->length},
+        {ping, sizeof(ping)}};
+    struct msghdr message = {0};
+    message.msg_iov = parts;
+    message.msg_iovlen = 3;
+
+    size_t total = header_length + 4 + record->length + sizeof(ping);
+    sent_at[index] = now_ns();
+    return sendmsg(connection->fd, &message, MSG_NOSIGNAL) == (ssize_t)total ? 0 : -1;
+}
+
+static void send_close(replay_connection_t *connection)
+{
+    const unsigned char close_frame[] = {0x88, 0x82, 0, 0, 0, 0, 0x03, 0xE8};
+    send(connection->fd, close_frame, sizeof(close_frame), MSG_NOSIGNAL);
+    atomic_store(&connection->closed, true);
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Each loop thread buffers its own records, so the log is only ordered per
+// thread. Records are replayed by timestamp, ties kept in file order.
+static int compare_records(const void *a, const void *b)
+{
+    const trace_record_t *x = *(const trace_record_t *const *)a;
+    const trace_record_t *y = *(const trace_record_t *const *)b;
+    if (x->timestamp_ns != y->timestamp_ns)
+        return x->timestamp_ns < y->timestamp_ns ? -1 : 1;
+    return x < y ? -1 : x > y;
+}
+
+static void usage(const char *program)
+{
+    fprintf(stderr,
+            "usage: %s [-h host] [-p port] [-H 'Header: value'] [-s speed | -f] traffic.log\n"
+            "  -s  replay at this multiple of the recorded pacing (default 1)\n"
+            "  -f  send as fast as possible\n",
+            program);
+}
+
+int main(int argc, char **argv)
+{
+    int option;
+    while ((option = getopt(argc, argv, "h:p:H:s:f")) != -1)
+    {
+        switch (option)
+        {
+        case 'h':
+            host = optarg;
+            break;
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'H':
+            if (header_count < MAX_HEADERS)
+                headers[header_count++] = optarg;
+            break;
+        case 's':
+            speed = atof(optarg);
+            break;
+        case 'f':
+            speed = 0;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind != argc - 1 || speed < 0)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    int log_fd = open(argv[optind], O_RDONLY);
+    struct stat log_stat;
+    if (log_fd < 0 || fstat(log_fd, &log_stat) != 0 || log_stat.st_size == 0)
+    {
+        perror(argv[optind]);
+        return 1;
+    }
+    const unsigned char *log = mmap(NULL, log_stat.st_size, PROT_READ, MAP_PRIVATE, log_fd, 0);
+    if (log == MAP_FAILED)
+    {
+        perror("mmap");
+        return 1;
+    }
+    size_t log_size = log_stat.st_size;
+    madvise((void *)log, log_size, MADV_SEQUENTIAL);
+
+    // First pass: size the tables.
+    size_t messages = 0, records = 0, offset = 0;
+    const trace_record_t *record;
+    while ((record = trace_next(log, log_size, &offset)))
+    {
+        records++;
+        if (record->kind == SOCKLET_TRACE_TEXT || record->kind == SOCKLET_TRACE_BINARY)
+            messages++;
+    }
+    if (records == 0)
+    {
+        fprintf(stderr, "%s: not a socklet traffic log, or empty\n", argv[optind]);
+        return 1;
+    }
+    if (offset != log_size)
+        fprintf(stderr, "warning: ignoring %zu bytes after the last complete record\n", log_size - offset);
+
+    const trace_record_t **order = malloc(sizeof(trace_record_t *) * records);
+    if (!order)
+    {
+        perror("setup");
+        return 1;
+    }
+    offset = 0;
+    for (size_t i = 0; (record = trace_next(log, log_size, &offset)); i++)
+    {
+        order[i] = record;
+    }
+    qsort(order, records, sizeof(trace_record_t *), compare_records);
+
+    connection_table_t table;
+    table.capacity = 64;
+    while (table.capacity < records * 2)
+    {
+        table.capacity *= 2;
+    }
+    table.slots = calloc(table.capacity, sizeof(replay_connection_t));
+    message_count = messages;
+    sent_at = calloc(messages ? messages : 1, sizeof(uint64_t));
+    latency = calloc(messages ? messages : 1, sizeof(uint64_t));
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (!table.slots || !sent_at || !latency || epoll_fd < 0)
+    {
+        perror("setup");
+        return 1;
+    }
+
+    pthread_t receiver;
+    pthread_create(&receiver, NULL, receive_thread, &messages);
+
+    size_t connections = 0, sent = 0, failed = 0, refused = 0;
+    uint64_t bytes = 0, first_timestamp = 0;
+    bool first = true;
+    uint64_t started = now_ns();
+
+    for (size_t i = 0; i < records; i++)
+    {
+        record = order[i];
+        if (first)
+        {
+            first_timestamp = record->timestamp_ns;
+            first = false;
+        }
+
+        if (speed > 0 && record->timestamp_ns > first_timestamp)
+        {
+            uint64_t due = started + (uint64_t)((record->timestamp_ns - first_timestamp) / speed);
+            struct timespec until = {(time_t)(due / 1000000000ULL), (long)(due % 1000000000ULL)};
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL) == EINTR)
+            {
+            }
+        }
+
+        replay_connection_t *connection = connection_find(&table, record->connection);
+        if (!connection->open)
+        {
+            // Connections are opened on their first record, which also covers
+            // ones adopted through a hot restart without an open record.
+            connection->id = record->connection;
+            connection->open = true;
+            connection->fd = -1;
+            if (connection_open(connection) == 0)
+                connections++;
+            else
+                refused++;
+        }
+
+        if (connection->fd < 0 || atomic_load(&connection->closed))
+        {
+            if (record->kind == SOCKLET_TRACE_TEXT || record->kind == SOCKLET_TRACE_BINARY)
+                failed++;
+            continue;
+        }
+
+        if (record->kind == SOCKLET_TRACE_CLOSE)
+        {
+            send_close(connection);
+        }
+        else if (record->kind == SOCKLET_TRACE_TEXT || record->kind == SOCKLET_TRACE_BINARY)
+        {
+            if (send_message(connection, record, sent) == 0)
+            {
+                sent++;
+                bytes += record->length;
+            }
+            else
+            {
+                failed++;
+            }
+        }
+    }
+
+    uint64_t sending_time = now_ns() - started;
+    atomic_store(&sending_done, true);
+    pthread_join(receiver, NULL);
+    uint64_t elapsed = now_ns() - started;
+
+    size_t answered = 0;
+    for (size_t i = 0; i < sent; i++)
+    {
+        if (latency[i])
+            latency[answered++] = latency[i];
+    }
+    qsort(latency, answered, sizeof(uint64_t), compare_u64);
+
+    printf("Replayed %s: %zu records, %zu connections (%zu refused)\n", argv[optind], records, connections, refused);
+    printf("Messages: %zu sent, %zu answered, %zu failed, %zu connections closed by the server\n",
+           sent, answered, failed, atomic_load(&server_closed));
+    printf("Sending:  %.3f s, %.0f msg/s, %.2f MB/s\n", sending_time / 1e9, sent / (sending_time / 1e9),
+           bytes / (sending_time / 1e9) / (1024 * 1024));
+    printf("Total:    %.3f s until the last pong\n", elapsed / 1e9);
+    if (answered > 0)
+    {
+        printf("Latency:  p50 %.1f us, p90 %.1f us, p99 %.1f us, max %.1f us\n",
+               latency[answered / 2] / 1e3, latency[answered * 9 / 10] / 1e3,
+               latency[answered * 99 / 100] / 1e3, latency[answered - 1] / 1e3);
+    }
+
+    for (size_t i = 0; i < table.capacity; i++)
+    {
+        if (table.slots[i].open && table.slots[i].fd >= 0)
+            close(table.slots[i].fd);
+    }
+    free(order);
+    munmap((void *)log, log_size);
+    close(log_fd);
+    return answered == sent ? 0 : 1;
+}
@@ -0,0 +1,108 @@
+#define SOCKLET_IMPLEMENTATION
+
+#include "../socklet.h"
+
+#define PAYLOAD_SIZE (16 * 1024)
+#define ROUNDS 20000
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void fill_ascii(unsigned char *payload, size_t length)
+{
+    const char *pattern = "{\"type\":\"socklet:dispatch\",\"event\":\"chat\",\"data\":\"hello world\"} ";
+    size_t pattern_length = strlen(pattern);
+    for (size_t i = 0; i < length; i++)
+    {
+        payload[i] = pattern[i % pattern_length];
+    }
+}
+
+static void fill_mixed(unsigned char *payload, size_t length)
+{
+    // Latin text with accented letters, CJK and emoji, roughly a third multi-byte
+    const char *pattern = "caf\xc3\xa9 na\xc3\xafve \xe6\x97\xa5\xe6\x9c\xac\xe8\xaa\x9e \xf0\x9f\x98\x80 text ";
+    size_t pattern_length = strlen(pattern);
+    size_t i = 0;
+    while (i + pattern_length <= length)
+    {
+        memcpy(payload + i, pattern, pattern_length);
+        i += pattern_length;
+    }
+    memset(payload + i, ' ', length - i);
+}
+
+static void naive_unmask(unsigned char *payload, size_t length, const unsigned char mask[4])
+{
+    for (size_t i = 0; i < length; i++)
+    {
+        payload[i] ^= mask[i % 4];
+    }
+}
+
+static void run(const char *input_name, const unsigned char *input, int implementation)
+{
+    static unsigned char masked[PAYLOAD_SIZE];
+    static unsigned char work[PAYLOAD_SIZE];
+    const unsigned char mask[4] = {0x12, 0x34, 0x56, 0x78};
+
+    if (utf8_set_implementation(implementation) != 0)
+        return;
+
+    memcpy(masked, input, PAYLOAD_SIZE);
+    naive_unmask(masked, PAYLOAD_SIZE, mask);
+
+    double start = now_seconds();
+    bool valid = true;
+    for (int round = 0; round < ROUNDS; round++)
+    {
+        valid &= utf8_validate(input, PAYLOAD_SIZE);
+    }
+    double validate_seconds = now_seconds() - start;
+
+    start = now_seconds();
+    for (int round = 0; round < ROUNDS; round++)
+    {
+        memcpy(work, masked, PAYLOAD_SIZE);
+        utf8_validator_t validator;
+        utf8_validator_init(&validator);
+        utf8_unmask_validate(&validator, work, PAYLOAD_SIZE, mask, 0);
+        valid &= utf8_finish(&validator);
+    }
+    double fused_seconds = now_seconds() - start;
+
+    start = now_seconds();
+    for (int round = 0; round < ROUNDS; round++)
+    {
+        memcpy(work, masked, PAYLOAD_SIZE);
+        naive_unmask(work, PAYLOAD_SIZE, mask);
+    }
+    double unmask_seconds = now_seconds() - start;
+
+    double megabytes = (double)PAYLOAD_SIZE * ROUNDS / (1024 * 1024);
+    printf("%-6s %-7s validate %8.0f MB/s   unmask+validate %8.0f MB/s   byte-loop unmask only %8.0f MB/s%s\n",
+           input_name, utf8_implementation_name(), megabytes / validate_seconds, megabytes / fused_seconds,
+           megabytes / unmask_seconds, valid ? "" : "   (INVALID)");
+}
+
+int main(void)
+{
+    static unsigned char ascii[PAYLOAD_SIZE];
+    static unsigned char mixed[PAYLOAD_SIZE];
+
+    fill_ascii(ascii, PAYLOAD_SIZE);
+    fill_mixed(mixed, PAYLOAD_SIZE);
+
+    printf("UTF-8 validation, %d KB payloads\n", PAYLOAD_SIZE / 1024);
+    for (int implementation = SOCKLET_UTF8_SCALAR; implementation <= SOCKLET_UTF8_AVX2; implementation++)
+    {
+        run("ascii", ascii, implementation);
+        run("mixed", mixed, implementation);
+    }
+
+    return 0;
+}
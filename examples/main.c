@@ -2,6 +2,10 @@
 
 #include "../socklet.h"
 
+bus_t bus;
+bool bus_ready = false;
+int cpus[SOCKLET_MAX_CPUS];
+
 void callback(int client_fd, char *headers, client_t *client)
 {
     client->extra_info = strdup("1");
@@ -41,17 +45,180 @@ bool authentication_handler(int client_fd, char *headers)
     return true;
 }
 
+// Only clients whose extra_info matches the scope may go on.
+bool requireScope(middleware_context_t *context, void *arg)
+{
+    const char *info = context->client->extra_info;
+    if (info && strcmp(info, arg) == 0)
+        return true;
+    session_send(context->client, "forbidden");
+    return false;
+}
+
+// Messages for rooms and topics must look like "<name> <message>".
+bool requireTarget(middleware_context_t *context, void *arg)
+{
+    (void)arg;
+    const char *data = context->data;
+    return data[0] != ' ' && strchr(data, ' ') != NULL;
+}
+
+// Without the bus, messages only reach this process's clients.
+void publish(uint32_t target_kind, uint64_t target_id, const char *message)
+{
+    if (bus_ready)
+    {
+        bus_publish(&bus, target_kind, target_id, message);
+        return;
+    }
+
+    size_t message_length = strlen(message);
+    unsigned char *frame = malloc(message_length + 10);
+    if (!frame)
+        return;
+    size_t header_length = encode_frame_header(frame, 0x1, message_length);
+    memcpy(frame + header_length, message, message_length);
+    bus_deliver(target_kind, target_id, frame, header_length + message_length);
+    free(frame);
+}
+
 void sendMessage(client_t *client, void *data)
 {
-    send_frame(client->client_fd, data);
+    session_send(client, data);
+}
+
+void broadcastMessage(client_t *client, void *data)
+{
+    (void)client;
+    publish(SOCKLET_BUS_BROADCAST, 0, data);
+}
+
+void joinRoom(client_t *client, void *data)
+{
+    room_join(client, data);
+}
+
+void leaveRoom(client_t *client, void *data)
+{
+    room_leave(client, data);
+}
+
+void publishRoom(client_t *client, void *data)
+{
+    (void)client;
+    char *message = strchr(data, ' ');
+    if (!message)
+        return;
+    *message++ = '\0';
+    publish(SOCKLET_BUS_ROOM, room_id(data), message);
+}
+
+void subscribeTopic(client_t *client, void *data)
+{
+    topic_subscribe(client, data);
+}
+
+void publishTopic(client_t *client, void *data)
+{
+    (void)client;
+    char *message = strchr(data, ' ');
+    if (!message)
+        return;
+    *message++ = '\0';
+    topic_publish(data, message);
+}
+
+void cpuStats(client_t *client, void *data)
+{
+    (void)data;
+    cpu_stats_t stats[SOCKLET_MAX_CPUS];
+    size_t count = cpu_stats(stats, SOCKLET_MAX_CPUS);
+
+    char message[4096];
+    size_t length = snprintf(message, sizeof(message), "[");
+    for (size_t i = 0; i < count && length < sizeof(message); i++)
+    {
+        length += snprintf(message + length, sizeof(message) - length,
+                           "%s{\"cpu\":%d,\"node\":%d,\"connections\":%d,\"reads\":%llu,\"busy_ns\":%llu}",
+                           i ? "," : "", stats[i].cpu, stats[i].node, stats[i].connections,
+                           (unsigned long long)stats[i].reads, (unsigned long long)stats[i].busy_ns);
+    }
+    if (length < sizeof(message) - 1)
+        strcat(message, "]");
+    session_send(client, message);
+}
+
+void uploadFile(client_t *client, void *data)
+{
+    (void)data;
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/socklet-upload-%llx.bin", (unsigned long long)client->id);
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0)
+    {
+        perror("open upload file");
+        return;
+    }
+
+    client_stream(client, &stream_fd_handler, (void *)(intptr_t)fd);
+    session_send(client, path);
 }
 
 int main()
 {
     server_t server;
     server_init(&server, callback, authentication_handler);
+
+    // SOCKLET_HANDOFF=/tmp/socklet-example.sock lets a second copy take over
+    // the listener and connections; without it, copies share the port.
+    if (getenv("SOCKLET_HANDOFF"))
+    {
+        server_set_handoff(&server, getenv("SOCKLET_HANDOFF"));
+    }
+
+    // SOCKLET_CPUS=0,2,4 runs one event loop on each of those CPUs.
+    size_t cpu_count = 0;
+    for (char *cpu = getenv("SOCKLET_CPUS"); cpu && *cpu && cpu_count < SOCKLET_MAX_CPUS; cpu = strchr(cpu, ',') ? strchr(cpu, ',') + 1 : NULL)
+    {
+        cpus[cpu_count++] = atoi(cpu);
+    }
+    if (cpu_count > 0)
+    {
+        server_set_cpus(&server, cpus, cpu_count, true);
+    }
+
+    // SOCKLET_RECORD=/tmp/traffic.log records inbound messages for bin/replay.
+    if (getenv("SOCKLET_RECORD"))
+    {
+        server_set_recorder(&server, getenv("SOCKLET_RECORD"));
+    }
+
     register_event("sendMessage", sendMessage);
+    register_event("broadcastMessage", broadcastMessage);
+    register_event("uploadFile", uploadFile);
+    register_event("cpuStats", cpuStats);
+    register_event("joinRoom", joinRoom);
+    register_event("leaveRoom", leaveRoom);
+    register_event("publishRoom", publishRoom);
+    register_event("subscribeTopic", subscribeTopic);
+    register_event("publishTopic", publishTopic);
+
+    use_event_middleware("broadcastMessage", requireScope, "1");
+    use_event_middleware("publishRoom", requireTarget, NULL);
+    use_event_middleware("publishTopic", requireTarget, NULL);
+
+    server_set_rate_limit(&server, 500, 200, SOCKLET_LIMIT_DISCONNECT);
+    event_set_rate_limit("broadcastMessage", 10, 20, SOCKLET_LIMIT_DROP);
+    event_set_rate_limit("publishRoom", 50, 10, SOCKLET_LIMIT_DELAY);
+
+    if (bus_open(&bus, "/socklet-example") == 0 && bus_start(&bus) == 0)
+    {
+        bus_ready = true;
+    }
+
     server_listen(&server, 8081);
     server_close(&server);
+    bus_close(&bus);
     return 0;
 }
\ No newline at end of file
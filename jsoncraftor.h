@@ -25,6 +25,11 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 // Define the mapping between JSON key and struct member
 typedef struct JsonMap {
@@ -52,73 +57,117 @@ static bool is_end(const char* ptr) {
     return *ptr == '\0';
 }
 
-// Parse a single value based on type
-static bool parse_value(const char** ptr, JsonMap* map, char** error, bool* found) {
+static void skip_whitespace(const char** ptr) {
     while (**ptr && (**ptr == ' ' || **ptr == '\n' || **ptr == '\t' || **ptr == '\r')) (*ptr)++;
-    
-    switch (map->type) {
-        case 'i': {
-            char* endptr;
-            long val = strtol(*ptr, &endptr, 10);
-            if (*ptr == endptr) {
-                *error = "Invalid integer value";
-                return false;
-            }
-            *(int*)map->struct_member = (int)val;
-            *ptr = endptr;
-            *found = true;
-            return true;
-        }
-        case 's': {
-            if (**ptr != '"') {
-                *error = "Expected string value";
-                return false;
-            }
+}
+
+// Skip a value of any type, including strings that contain brackets or escapes
+static void skip_value(const char** ptr) {
+    int depth = 0;
+    skip_whitespace(ptr);
+    while (**ptr) {
+        char c = **ptr;
+        if (c == '"') {
             (*ptr)++;
-            char* str_start = (char*)*ptr;
-            while (**ptr && **ptr != '"') (*ptr)++;
-            if (**ptr != '"') {
-                *error = "Unterminated string";
-                return false;
-            }
-            size_t len = *ptr - str_start;
-            if (len >= map->size) {
-                *error = "String too long";
-                return false;
+            while (**ptr && **ptr != '"') {
+                if (**ptr == '\\' && (*ptr)[1]) (*ptr)++;
+                (*ptr)++;
             }
-            strncpy(map->struct_member, str_start, len);
-            ((char*)map->struct_member)[len] = '\0';
+            if (**ptr) (*ptr)++;
+        } else if (c == '{' || c == '[') {
+            depth++;
+            (*ptr)++;
+        } else if (c == '}' || c == ']') {
+            if (depth == 0) return;
+            depth--;
+            (*ptr)++;
+        } else if (c == ',' && depth == 0) {
+            return;
+        } else {
             (*ptr)++;
-            *found = true;
-            return true;
-        }
-        case 'b': {
-            if (strncmp(*ptr, "true", 4) == 0) {
-                *(bool*)map->struct_member = true;
-                *ptr += 4;
-                *found = true;
-                return true;
-            } else if (strncmp(*ptr, "false", 5) == 0) {
-                *(bool*)map->struct_member = false;
-                *ptr += 5;
-                *found = true;
-                return true;
-            }
-            *error = "Invalid boolean value";
-            return false;
-        }
-        case 'd': {
-            char* endptr;
-            double val = strtod(*ptr, &endptr);
-            if (*ptr == endptr) {
-                *error = "Invalid double value";
-                return false;
-            }
-            *(double*)map->struct_member = val;
-            *ptr = endptr;
-            *found = true;
-            return true;
         }
+    }
+}
+
+// Typed value parsers. They share one signature so generated schema parsers
+// can call them directly; `size` is the buffer size for strings.
+static bool json_parse_int(const char** ptr, void* out, size_t size, char** error) {
+    (void)size;
+    char* endptr;
+    long val = strtol(*ptr, &endptr, 10);
+    if (*ptr == endptr) {
+        *error = "Invalid integer value";
+        return false;
+    }
+    *(int*)out = (int)val;
+    *ptr = endptr;
+    return true;
+}
+
+static bool json_parse_string(const char** ptr, void* out, size_t size, char** error) {
+    if (**ptr != '"') {
+        *error = "Expected string value";
+        return false;
+    }
+    (*ptr)++;
+    const char* str_start = *ptr;
+    const char* str_end = strchr(str_start, '"');
+    if (!str_end) {
+        *error = "Unterminated string";
+        return false;
+    }
+    size_t len = str_end - str_start;
+    if (len >= size) {
+        *error = "String too long";
+        return false;
+    }
+    memcpy(out, str_start, len);
+    ((char*)out)[len] = '\0';
+    *ptr = str_end + 1;
+    return true;
+}
+
+static bool json_parse_bool(const char** ptr, void* out, size_t size, char** error) {
+    (void)size;
+    if (strncmp(*ptr, "true", 4) == 0) {
+        *(bool*)out = true;
+        *ptr += 4;
+        return true;
+    } else if (strncmp(*ptr, "false", 5) == 0) {
+        *(bool*)out = false;
+        *ptr += 5;
+        return true;
+    }
+    *error = "Invalid boolean value";
+    return false;
+}
+
+static bool json_parse_double(const char** ptr, void* out, size_t size, char** error) {
+    (void)size;
+    char* endptr;
+    double val = strtod(*ptr, &endptr);
+    if (*ptr == endptr) {
+        *error = "Invalid double value";
+        return false;
+    }
+    *(double*)out = val;
+    *ptr = endptr;
+    return true;
+}
+
+// Parse a single value based on type
+static bool parse_value(const char** ptr, JsonMap* map, char** error, bool* found) {
+    skip_whitespace(ptr);
+    
+    switch (map->type) {
+        case 'i':
+            return (*found = json_parse_int(ptr, map->struct_member, map->size, error));
+        case 's':
+            return (*found = json_parse_string(ptr, map->struct_member, map->size, error));
+        case 'b':
+            return (*found = json_parse_bool(ptr, map->struct_member, map->size, error));
+        case 'd':
+            return (*found = json_parse_double(ptr, map->struct_member, map->size, error));
         case 'o': {
             if (**ptr != '{') {
                 *error = "Expected object";
@@ -172,12 +221,7 @@ static bool parse_value(const char** ptr, JsonMap* map, char** error, bool* foun
                     }
                 } else {
                     // Skip unknown property
-                    int depth = 1;
-                    while (**ptr && depth > 0) {
-                        if (**ptr == '{' || **ptr == '[') depth++;
-                        if (**ptr == '}' || **ptr == ']') depth--;
-                        (*ptr)++;
-                    }
+                    skip_value(ptr);
                 }
                 
                 skip_char(ptr, ',');
@@ -356,12 +400,7 @@ bool parse_json(const char* json, JsonMap* mappings, int map_count, char** error
             }
         } else {
             // Skip unknown property
-            int depth = 1;
-            while (*ptr && depth > 0) {
-                if (*ptr == '{' || *ptr == '[') depth++;
-                if (*ptr == '}' || *ptr == ']') depth--;
-                ptr++;
-            }
+            skip_value(&ptr);
         }
         
         first_field = false;
@@ -387,4 +426,464 @@ bool parse_json(const char* json, JsonMap* mappings, int map_count, char** error
     return true;
 }
 
+
+// Output buffer for the serializer. `reserve` bytes are kept free in front of
+// the JSON text so a caller can prepend a frame header without copying.
+typedef struct JsonWriter {
+    char* buffer;           // Start of the caller-provided buffer
+    size_t capacity;        // Total size of the buffer
+    size_t reserve;         // Bytes kept free before the JSON text
+    size_t length;          // Bytes of JSON written after the reserve
+    bool overflow;          // Set once a write did not fit
+} JsonWriter;
+
+// Bump allocator for writers that should not own their buffers
+typedef struct JsonArena {
+    char* base;
+    size_t capacity;
+    size_t used;
+} JsonArena;
+
+void json_arena_init(JsonArena* arena, char* base, size_t capacity) {
+    arena->base = base;
+    arena->capacity = capacity;
+    arena->used = 0;
+}
+
+void json_arena_reset(JsonArena* arena) {
+    arena->used = 0;
+}
+
+void json_writer_init(JsonWriter* writer, char* buffer, size_t capacity, size_t reserve) {
+    writer->buffer = buffer;
+    writer->capacity = capacity;
+    writer->reserve = reserve < capacity ? reserve : capacity;
+    writer->length = 0;
+    writer->overflow = false;
+}
+
+// Hand the rest of the arena to a writer; json_arena_commit() keeps what it used
+void json_writer_init_arena(JsonWriter* writer, JsonArena* arena, size_t reserve) {
+    json_writer_init(writer, arena->base + arena->used, arena->capacity - arena->used, reserve);
+}
+
+void json_arena_commit(JsonArena* arena, const JsonWriter* writer) {
+    arena->used += writer->reserve + writer->length;
+}
+
+char* json_writer_data(const JsonWriter* writer) {
+    return writer->buffer + writer->reserve;
+}
+
+// Reserve `count` bytes at the end of the output, or NULL if they do not fit
+static char* json_writer_claim(JsonWriter* writer, size_t count) {
+    if (writer->overflow || count > writer->capacity - writer->reserve - writer->length) {
+        writer->overflow = true;
+        return NULL;
+    }
+    char* out = writer->buffer + writer->reserve + writer->length;
+    writer->length += count;
+    return out;
+}
+
+void json_write_raw(JsonWriter* writer, const char* text, size_t length) {
+    char* out = json_writer_claim(writer, length);
+    if (out) memcpy(out, text, length);
+}
+
+static const char json_digit_pairs[201] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+// Write digits two at a time from the end of a scratch buffer
+static size_t json_format_uint64(char* end, uint64_t value) {
+    char* p = end;
+    while (value >= 100) {
+        unsigned pair = (unsigned)(value % 100) * 2;
+        value /= 100;
+        *--p = json_digit_pairs[pair + 1];
+        *--p = json_digit_pairs[pair];
+    }
+    if (value >= 10) {
+        unsigned pair = (unsigned)value * 2;
+        *--p = json_digit_pairs[pair + 1];
+        *--p = json_digit_pairs[pair];
+    } else {
+        *--p = (char)('0' + value);
+    }
+    return end - p;
+}
+
+void json_write_int64(JsonWriter* writer, int64_t value) {
+    char scratch[21];
+    char* end = scratch + sizeof(scratch);
+    uint64_t magnitude = value < 0 ? 0 - (uint64_t)value : (uint64_t)value;
+    size_t length = json_format_uint64(end, magnitude);
+    if (value < 0) scratch[sizeof(scratch) - ++length] = '-';
+    json_write_raw(writer, end - length, length);
+}
+
+void json_write_bool(JsonWriter* writer, bool value) {
+    if (value) json_write_raw(writer, "true", 4);
+    else json_write_raw(writer, "false", 5);
+}
+
+void json_write_double(JsonWriter* writer, double value) {
+    // JSON has no representation for NaN or infinities
+    if (value != value || value > 1.7976931348623157e308 || value < -1.7976931348623157e308) {
+        json_write_raw(writer, "null", 4);
+        return;
+    }
+
+    // Fast path for values with at most six decimals: the output is exact
+    // whenever dividing the scaled integer back reproduces the same double.
+    double scaled = value * 1e6;
+    if (scaled > -9007199254740992.0 && scaled < 9007199254740992.0) {
+        int64_t units = (int64_t)scaled;
+        if ((double)units == scaled && (double)units / 1e6 == value) {
+            char scratch[32];
+            char* end = scratch + sizeof(scratch);
+            uint64_t magnitude = units < 0 ? 0 - (uint64_t)units : (uint64_t)units;
+            uint64_t fraction = magnitude % 1000000;
+            size_t length = 0;
+
+            if (fraction) {
+                int digits = 6;
+                while (fraction % 10 == 0) {
+                    fraction /= 10;
+                    digits--;
+                }
+                size_t written = json_format_uint64(end, fraction);
+                while ((int)written < digits) scratch[sizeof(scratch) - ++written] = '0';
+                scratch[sizeof(scratch) - ++written] = '.';
+                length = written;
+            }
+            length += json_format_uint64(end - length, magnitude / 1000000);
+            if (units < 0) scratch[sizeof(scratch) - ++length] = '-';
+            json_write_raw(writer, end - length, length);
+            return;
+        }
+    }
+
+    char scratch[32];
+    int length = snprintf(scratch, sizeof(scratch), "%.17g", value);
+    json_write_raw(writer, scratch, (size_t)length);
+}
+
+static size_t json_escape_byte(char* out, unsigned char c) {
+    static const char hex[] = "0123456789abcdef";
+    out[0] = '\\';
+    switch (c) {
+        case '"': out[1] = '"'; return 2;
+        case '\\': out[1] = '\\'; return 2;
+        case '\n': out[1] = 'n'; return 2;
+        case '\r': out[1] = 'r'; return 2;
+        case '\t': out[1] = 't'; return 2;
+        case '\b': out[1] = 'b'; return 2;
+        case '\f': out[1] = 'f'; return 2;
+    }
+    out[1] = 'u';
+    out[2] = '0';
+    out[3] = '0';
+    out[4] = hex[c >> 4];
+    out[5] = hex[c & 0x0F];
+    return 6;
+}
+
+static bool json_needs_escape(unsigned char c) {
+    return c < 0x20 || c == '"' || c == '\\';
+}
+
+static size_t json_escaped_length(const unsigned char* in, size_t length) {
+    size_t total = length;
+    for (size_t i = 0; i < length; i++) {
+        if (!json_needs_escape(in[i])) continue;
+        switch (in[i]) {
+            case '"': case '\\': case '\n': case '\r': case '\t': case '\b': case '\f': total += 1; break;
+            default: total += 5; break;
+        }
+    }
+    return total;
+}
+
+// Write a quoted, escaped string. Clean runs are located 16 bytes at a time
+// and copied in bulk; only the bytes that need escaping take the slow path.
+void json_write_string(JsonWriter* writer, const char* text, size_t length) {
+    const unsigned char* in = (const unsigned char*)text;
+    const unsigned char* end = in + length;
+
+    // Claim the worst case, every byte a six byte \u escape, when it fits.
+    // Otherwise measure the escaped form so a string that fits is not refused.
+    size_t available = writer->overflow ? 0 : writer->capacity - writer->reserve - writer->length;
+    size_t claim = length * 6 + 2;
+    bool exact = claim > available;
+    if (exact) claim = json_escaped_length(in, length) + 2;
+
+    char* out = json_writer_claim(writer, claim);
+    if (!out) return;
+
+    char* start = out;
+    *out++ = '"';
+
+#if defined(__SSE2__)
+    // The vector loop stores 16 bytes ahead, which only the worst-case claim covers
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i control = _mm_set1_epi8(0x1F);
+    while (!exact && end - in >= 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i*)in);
+        __m128i special = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(chunk, quote), _mm_cmpeq_epi8(chunk, backslash)),
+            _mm_cmpeq_epi8(_mm_min_epu8(chunk, control), chunk));
+        _mm_storeu_si128((__m128i*)out, chunk);
+        unsigned mask = (unsigned)_mm_movemask_epi8(special);
+        if (!mask) {
+            in += 16;
+            out += 16;
+            continue;
+        }
+        unsigned clean = (unsigned)__builtin_ctz(mask);
+        in += clean;
+        out += clean;
+        out += json_escape_byte(out, *in++);
+    }
+#endif
+
+    while (in < end) {
+        if (json_needs_escape(*in)) out += json_escape_byte(out, *in);
+        else *out++ = (char)*in;
+        in++;
+    }
+    *out++ = '"';
+
+    // Give back the part of the worst-case claim that was not needed
+    writer->length -= claim - (size_t)(out - start);
+}
+
+static bool serialize_value(JsonWriter* writer, const JsonMap* map, const void* member, char** error);
+
+static bool serialize_members(JsonWriter* writer, const JsonMap* mappings, size_t map_count, char** error) {
+    json_write_raw(writer, "{", 1);
+    for (size_t i = 0; i < map_count; i++) {
+        if (i) json_write_raw(writer, ",", 1);
+        json_write_string(writer, mappings[i].json_key, strlen(mappings[i].json_key));
+        json_write_raw(writer, ":", 1);
+        if (!serialize_value(writer, &mappings[i], mappings[i].struct_member, error)) return false;
+    }
+    json_write_raw(writer, "}", 1);
+    return true;
+}
+
+// Serialize a single value based on type
+static bool serialize_value(JsonWriter* writer, const JsonMap* map, const void* member, char** error) {
+    switch (map->type) {
+        case 'i':
+            json_write_int64(writer, *(const int*)member);
+            return true;
+        case 's': {
+            const char* text = (const char*)member;
+            size_t length = 0;
+            while (length < map->size && text[length]) length++;
+            json_write_string(writer, text, length);
+            return true;
+        }
+        case 'b':
+            json_write_bool(writer, *(const bool*)member);
+            return true;
+        case 'd':
+            json_write_double(writer, *(const double*)member);
+            return true;
+        case 'o':
+            return serialize_members(writer, map->nested, map->size, error);
+        case 'a': {
+            const JsonMap* item_map = map->nested;
+            size_t item_size;
+            switch (item_map->type) {
+                case 's': item_size = item_map->size; break;
+                case 'i': item_size = sizeof(int); break;
+                case 'b': item_size = sizeof(bool); break;
+                case 'd': item_size = sizeof(double); break;
+                default:
+                    *error = "Unsupported array item type";
+                    return false;
+            }
+            json_write_raw(writer, "[", 1);
+            for (size_t i = 0; i < map->size; i++) {
+                if (i) json_write_raw(writer, ",", 1);
+                if (!serialize_value(writer, item_map, (const char*)member + i * item_size, error)) return false;
+            }
+            json_write_raw(writer, "]", 1);
+            return true;
+        }
+        default:
+            *error = "Unknown type";
+            return false;
+    }
+}
+
+// Main serializing function
+bool serialize_json(JsonWriter* writer, const JsonMap* mappings, int map_count, char** error) {
+    if (!serialize_members(writer, mappings, (size_t)map_count, error)) return false;
+    if (writer->overflow) {
+        *error = "Output buffer too small";
+        return false;
+    }
+    return true;
+}
+
+
+// Advance to the next property of an object whose '{' was consumed. Returns
+// 1 with the key in key_start/key_len, 0 at the closing brace, -1 on error.
+static int json_next_key(const char** ptr, bool* first, const char** key_start, size_t* key_len, char** error) {
+    if (skip_char(ptr, '}')) {
+        if (!is_end(*ptr)) {
+            *error = "Unexpected content after }";
+            return -1;
+        }
+        return 0;
+    }
+    if (!**ptr) {
+        *error = "Missing closing brace";
+        return -1;
+    }
+    if (!*first && !skip_char(ptr, ',')) {
+        *error = "Expected ,";
+        return -1;
+    }
+    if (skip_char(ptr, '}')) {
+        *error = "Trailing comma";
+        return -1;
+    }
+    if (**ptr != '"') {
+        *error = "Expected property name";
+        return -1;
+    }
+    (*ptr)++;
+    const char* key_end = strchr(*ptr, '"');
+    if (!key_end) {
+        *error = "Unterminated string";
+        return -1;
+    }
+    *key_start = *ptr;
+    *key_len = key_end - *ptr;
+    *ptr = key_end + 1;
+    if (!skip_char(ptr, ':')) {
+        *error = "Expected :";
+        return -1;
+    }
+    skip_whitespace(ptr);
+    *first = false;
+    return 1;
+}
+
+/* Compile-time schemas. A flat schema is declared once as an X-macro list:
+ *
+ *   #define POINT_FIELDS(FIELD, ARG) \
+ *       FIELD(ARG, x, JSON_INT, 0, true) \
+ *       FIELD(ARG, label, JSON_STRING, 32, false)
+ *
+ *   JSON_SCHEMA(Point, point, POINT_FIELDS)
+ *
+ * which expands into `typedef struct Point {...} Point`, a static JsonField
+ * table `point_fields`, point_bind() to fill a JsonMap for parse_json() or
+ * serialize_json(), point_serialize(), and point_parse(). The generated
+ * parser compares keys and calls the typed value parsers directly, with no
+ * table lookups or type switches at runtime. Absent fields are zeroed and
+ * a field that appears twice is an error.
+ */
+
+// Static description of one schema field; offsets replace struct pointers
+typedef struct JsonField {
+    const char* json_key;
+    size_t offset;
+    char type;
+    size_t size;
+    bool required;
+} JsonField;
+
+#define JSON_DECLARE_JSON_INT(name, size) int name;
+#define JSON_DECLARE_JSON_STRING(name, size) char name[size];
+#define JSON_DECLARE_JSON_BOOL(name, size) bool name;
+#define JSON_DECLARE_JSON_DOUBLE(name, size) double name;
+
+#define JSON_TYPE_JSON_INT 'i'
+#define JSON_TYPE_JSON_STRING 's'
+#define JSON_TYPE_JSON_BOOL 'b'
+#define JSON_TYPE_JSON_DOUBLE 'd'
+
+#define JSON_PARSER_JSON_INT json_parse_int
+#define JSON_PARSER_JSON_STRING json_parse_string
+#define JSON_PARSER_JSON_BOOL json_parse_bool
+#define JSON_PARSER_JSON_DOUBLE json_parse_double
+
+#define JSON_SCHEMA_MEMBER(S, name, kind, size, required) JSON_DECLARE_##kind(name, size)
+
+#define JSON_SCHEMA_INDEX(P, name, kind, size, required) P##_field_##name,
+
+#define JSON_SCHEMA_FIELD(S, name, kind, size, required) \
+    {#name, offsetof(S, name), JSON_TYPE_##kind, size, required},
+
+#define JSON_SCHEMA_MATCH(P, name, kind, size, required) \
+    if (key_len == sizeof(#name) - 1 && memcmp(key_start, #name, sizeof(#name) - 1) == 0) { \
+        if (seen & ((uint64_t)1 << P##_field_##name)) { \
+            *error = "Duplicate field"; \
+            return false; \
+        } \
+        if (!JSON_PARSER_##kind(&ptr, &out->name, size, error)) return false; \
+        seen |= (uint64_t)1 << P##_field_##name; \
+        continue; \
+    }
+
+#define JSON_SCHEMA_REQUIRE(P, name, kind, size, required) \
+    if (required && !(seen & ((uint64_t)1 << P##_field_##name))) { \
+        *error = "Missing required field"; \
+        return false; \
+    }
+
+#define JSON_SCHEMA(S, P, FIELDS) \
+    typedef struct S { FIELDS(JSON_SCHEMA_MEMBER, S) } S; \
+    enum { FIELDS(JSON_SCHEMA_INDEX, P) P##_field_count }; \
+    _Static_assert(P##_field_count <= 64, "JSON_SCHEMA supports at most 64 fields"); \
+    static const JsonField P##_fields[] = { FIELDS(JSON_SCHEMA_FIELD, S) }; \
+    static inline void P##_bind(S* value, JsonMap* mappings) { \
+        for (size_t i = 0; i < P##_field_count; i++) { \
+            mappings[i].json_key = P##_fields[i].json_key; \
+            mappings[i].struct_member = (char*)value + P##_fields[i].offset; \
+            mappings[i].type = P##_fields[i].type; \
+            mappings[i].size = P##_fields[i].size; \
+            mappings[i].required = P##_fields[i].required; \
+            mappings[i].nested = NULL; \
+        } \
+    } \
+    static inline bool P##_serialize(JsonWriter* writer, const S* value, char** error) { \
+        JsonMap mappings[P##_field_count]; \
+        P##_bind((S*)value, mappings); \
+        return serialize_json(writer, mappings, P##_field_count, error); \
+    } \
+    static inline bool P##_parse(const char* json, S* out, char** error) { \
+        const char* ptr = json; \
+        const char* key_start; \
+        size_t key_len; \
+        bool first = true; \
+        uint64_t seen = 0; \
+        int status; \
+        if (!json) { \
+            *error = "NULL input"; \
+            return false; \
+        } \
+        memset(out, 0, sizeof(*out)); \
+        if (!skip_char(&ptr, '{')) { \
+            *error = "Expected {"; \
+            return false; \
+        } \
+        while ((status = json_next_key(&ptr, &first, &key_start, &key_len, error)) > 0) { \
+            FIELDS(JSON_SCHEMA_MATCH, P) \
+            skip_value(&ptr); \
+        } \
+        if (status < 0) return false; \
+        FIELDS(JSON_SCHEMA_REQUIRE, P) \
+        return true; \
+    }
+
 #endif
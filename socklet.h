@@ -7,70 +7,800 @@
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <limits.h>
 #include <pthread.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <linux/mempolicy.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 #include <openssl/sha.h>
 #include <openssl/bio.h>
 #include <openssl/evp.h>
 #include <openssl/buffer.h>
+#include <openssl/rand.h>
 #include "jsoncraftor.h"
 
 #define BUFFER_SIZE 1024
 
+#ifndef SOCKLET_BUS_SLOTS
+#define SOCKLET_BUS_SLOTS 1024
+#endif
+
+#ifndef SOCKLET_BUS_SLOT_SIZE
+#define SOCKLET_BUS_SLOT_SIZE 4096
+#endif
+
+#ifndef SOCKLET_BUS_STALL_MS
+#define SOCKLET_BUS_STALL_MS 1000
+#endif
+
+#define SOCKLET_BUS_MAGIC 0x534b4255
+
+#ifndef SOCKLET_REPLAY_CAPACITY
+#define SOCKLET_REPLAY_CAPACITY 64
+#endif
+
+#ifndef SOCKLET_REPLAY_MAX_BYTES
+#define SOCKLET_REPLAY_MAX_BYTES 65536
+#endif
+
+#ifndef SOCKLET_MAX_SESSIONS
+#define SOCKLET_MAX_SESSIONS 4096
+#endif
+
+#ifndef SOCKLET_SESSION_TTL
+#define SOCKLET_SESSION_TTL 120
+#endif
+
+#define SOCKLET_SESSION_BUCKETS 1024
+#define SOCKLET_SESSION_TOKEN_SIZE 33
+
+#ifndef SOCKLET_CHUNK_SIZE
+#define SOCKLET_CHUNK_SIZE 16384
+#endif
+
+#ifndef SOCKLET_CONNECTION_MEMORY
+#define SOCKLET_CONNECTION_MEMORY 65536
+#endif
+
+#ifndef SOCKLET_ROOM_BUCKETS
+#define SOCKLET_ROOM_BUCKETS 1024
+#endif
+
+#define SOCKLET_TOPIC_MAX_DEPTH 16
+
+#ifndef SOCKLET_LISTEN_BACKLOG
+#define SOCKLET_LISTEN_BACKLOG SOMAXCONN
+#endif
+
+#ifndef SOCKLET_HANDOFF_DRAIN_MS
+#define SOCKLET_HANDOFF_DRAIN_MS 5000
+#endif
+
+#ifndef SOCKLET_MAX_CPUS
+#define SOCKLET_MAX_CPUS 256
+#endif
+
+#ifndef SOCKLET_POOL_BLOCK_SIZE
+#define SOCKLET_POOL_BLOCK_SIZE 4096
+#endif
+
+#ifndef SOCKLET_POOL_CACHED
+#define SOCKLET_POOL_CACHED 256
+#endif
+
+#ifndef SOCKLET_OUTPUT_LIMIT
+#define SOCKLET_OUTPUT_LIMIT (4 << 20)
+#endif
+
+#ifndef SOCKLET_HANDSHAKE_TIMEOUT_MS
+#define SOCKLET_HANDSHAKE_TIMEOUT_MS 10000
+#endif
+
+#define SOCKLET_LOOP_EVENTS 256
+
+#ifndef SOCKLET_LIMITED_EVENTS
+#define SOCKLET_LIMITED_EVENTS 8
+#endif
+
+#ifndef SOCKLET_MIDDLEWARE_LOCALS
+#define SOCKLET_MIDDLEWARE_LOCALS 4
+#endif
+
+#define SOCKLET_EVENT_BUCKETS 256
+
+#ifndef SOCKLET_TRACE_BUFFER_SIZE
+#define SOCKLET_TRACE_BUFFER_SIZE (1 << 20)
+#endif
+
+#ifndef SOCKLET_TRACE_FLUSH_MS
+#define SOCKLET_TRACE_FLUSH_MS 100
+#endif
+
+#define SOCKLET_TRACE_MAGIC "SKLTRACE"
+#define SOCKLET_TRACE_VERSION 1
+#define SOCKLET_TRACE_ALIGN(length) (((length) + 7) & ~(size_t)7)
+
+#define SOCKLET_HANDOFF_MAGIC 0x534b484f
+#define SOCKLET_HANDOFF_RECORD_SIZE 65536
+
+#define SOCKLET_CLOSE_NORMAL 1000
+#define SOCKLET_CLOSE_GOING_AWAY 1001
+#define SOCKLET_CLOSE_PROTOCOL_ERROR 1002
+#define SOCKLET_CLOSE_INVALID_PAYLOAD 1007
+#define SOCKLET_CLOSE_POLICY_VIOLATION 1008
+#define SOCKLET_CLOSE_MESSAGE_TOO_BIG 1009
+
+enum
+{
+    SOCKLET_BUS_BROADCAST = 0,
+    SOCKLET_BUS_CLIENT = 1,
+    SOCKLET_BUS_ROOM = 2
+};
+
+enum
+{
+    SOCKLET_TRACE_TEXT = 0x1,
+    SOCKLET_TRACE_BINARY = 0x2,
+    SOCKLET_TRACE_OPEN = 0x10,
+    SOCKLET_TRACE_CLOSE = 0x11
+};
+
+enum
+{
+    SOCKLET_UTF8_SCALAR = 0,
+    SOCKLET_UTF8_SSSE3 = 1,
+    SOCKLET_UTF8_AVX2 = 2
+};
+
+enum
+{
+    SOCKLET_CLIENT_HANDSHAKE = 0,
+    SOCKLET_CLIENT_OPEN = 1
+};
+
+enum
+{
+    SOCKLET_LIMIT_DROP = 0,
+    SOCKLET_LIMIT_DELAY = 1,
+    SOCKLET_LIMIT_DISCONNECT = 2
+};
+
+enum
+{
+    SOCKLET_HANDOFF_LISTENER = 1,
+    SOCKLET_HANDOFF_CLIENT = 2,
+    SOCKLET_HANDOFF_END = 3
+};
+
+struct session;
+struct client;
+struct server;
+struct event_loop;
+
+typedef struct pool_block
+{
+    struct pool_block *next;
+} pool_block_t;
+
+typedef struct
+{
+    pool_block_t *free;
+    size_t cached;
+} buffer_pool_t;
+
+typedef struct
+{
+    uint64_t interval_ns;
+    uint64_t tolerance_ns;
+    int action;
+} rate_limit_t;
+
+typedef struct
+{
+    uint64_t dropped;
+    uint64_t delayed;
+    uint64_t disconnected;
+    uint64_t shed_bytes;
+} rate_limit_stats_t;
+
+typedef struct
+{
+    uint32_t slot;
+    uint32_t membership;
+} member_t;
+
+typedef struct
+{
+    member_t *members;
+    uint32_t count;
+    uint32_t capacity;
+} member_set_t;
+
+typedef struct
+{
+    member_set_t *set;
+    uint32_t position;
+    bool topic;
+} membership_t;
+
+typedef struct
+{
+    bool (*on_start)(struct client *client);
+    bool (*on_chunk)(struct client *client, const unsigned char *chunk, size_t length);
+    void (*on_end)(struct client *client, bool complete);
+} stream_handler_t;
+
+typedef struct
+{
+    unsigned char previous[32];
+    unsigned char incomplete[32];
+    unsigned char carry[32];
+    uint8_t carry_length;
+    uint8_t error;
+    uint8_t remaining;
+    uint8_t lower;
+    uint8_t upper;
+} utf8_validator_t;
+
 typedef struct
 {
+    unsigned char header[14];
+    uint8_t header_length;
+    uint8_t header_needed;
+    unsigned char opcode;
+    unsigned char message_opcode;
+    bool fin;
+    bool streaming;
+    bool pooled;
+    unsigned char mask[4];
+    uint64_t payload_length;
+    uint64_t payload_received;
+    unsigned char *message;
+    size_t message_length;
+    size_t message_capacity;
+    size_t message_limit;
+    buffer_pool_t *pool;
+    unsigned char control[125];
+    utf8_validator_t utf8;
+} frame_reader_t;
+
+typedef struct client
+{
+    uint64_t id;
+    uint32_t slot;
+    int index;
     int client_fd;
     struct sockaddr_in client_address;
     char *extra_info;
+    struct session *session;
+    membership_t *memberships;
+    uint32_t *membership_index;
+    uint32_t membership_count;
+    uint32_t membership_capacity;
+    struct server *server;
+    struct event_loop *loop;
+    int cpu;
+    unsigned char state;
+    unsigned char rate_stage;
+    bool held;
+    uint32_t shed;
+    uint64_t rate_tat;
+    uint64_t event_tat[SOCKLET_LIMITED_EVENTS];
+    uint64_t resume_at;
+    struct client *timer_next;
+    struct client *loop_prev;
+    struct client *loop_next;
+    char *request;
+    size_t request_length;
+    unsigned char *pending;
+    size_t pending_length;
+    frame_reader_t reader;
+    const stream_handler_t *stream_handler;
+    void *stream_context;
+    pthread_mutex_t output_lock;
+    unsigned char *output;
+    size_t output_offset;
+    size_t output_length;
+    size_t output_capacity;
+    struct client *flush_next;
+    bool flush_posted;
+    bool output_closed;
+    bool output_failed;
+    bool writing;
 } client_t;
 
+// Traffic log: one trace_header_t, then trace_record_t entries, each followed
+// by its payload padded to 8 bytes, so the file can be walked in place.
 typedef struct
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    int64_t epoch_ns;
+} trace_header_t;
+
+typedef struct
+{
+    uint64_t timestamp_ns;
+    uint64_t connection;
+    uint32_t length;
+    uint8_t kind;
+    uint8_t reserved[3];
+} trace_record_t;
+
+typedef struct trace_buffer
+{
+    struct trace_recorder *recorder;
+    pthread_t owner;
+    pthread_mutex_t lock;
+    pthread_cond_t swapped;
+    unsigned char *data;
+    size_t length;
+    size_t capacity;
+    unsigned char *spare;
+    size_t spare_capacity;
+    struct trace_buffer *next;
+} trace_buffer_t;
+
+typedef struct trace_recorder
+{
+    int fd;
+    int64_t epoch_ns;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t flushed;
+    trace_buffer_t *buffers;
+    uint64_t flush_requested;
+    uint64_t flush_completed;
+    atomic_bool failed;
+} trace_recorder_t;
+
+typedef struct server
 {
     int server_fd;
     struct sockaddr_in address;
     void (*callback)(int, char *, client_t *);
     bool (*authentication_handler)(int, char *);
+    const stream_handler_t *stream_handler;
+    size_t connection_memory;
+    const char *handoff_path;
+    int handoff_fd;
+    bool handed_off;
+    const int *cpus;
+    size_t cpu_count;
+    bool steer_incoming_cpu;
+    struct event_loop **loops;
+    size_t loop_count;
+    atomic_uint next_loop;
+    rate_limit_t rate_limit;
+    trace_recorder_t *recorder;
 } server_t;
 
-typedef struct client_data
+typedef struct
 {
-    int client_fd;
+    int fd;
+    client_t *client;
+} loop_entry_t;
+
+typedef struct event_loop
+{
+    int epoll_fd;
+    int wake_fd;
+    int cpu;
     server_t *server;
-} client_data_t;
+    pthread_mutex_t lock;
+    loop_entry_t *queue;
+    size_t queue_count;
+    size_t queue_capacity;
+    buffer_pool_t pool;
+    client_t *timers;
+    client_t *clients;
+    client_t *clients_tail;
+    client_t *handshakes;
+    client_t *flushes;
+    unsigned char buffer[SOCKLET_CHUNK_SIZE];
+} event_loop_t;
+
+typedef struct
+{
+    int cpu;
+    int node;
+    int connections;
+    uint64_t reads;
+    uint64_t bytes;
+    uint64_t busy_ns;
+} cpu_stats_t;
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t kind;
+    uint64_t id;
+    uint64_t sequence;
+    char session[SOCKLET_SESSION_TOKEN_SIZE];
+    uint32_t extra_length;
+    uint32_t memberships_length;
+} handoff_record_t;
+
+// Lives on the dispatching thread's stack for one message. A middleware may
+// replace `data` for the ones after it and the handler, and can pass values
+// along in `locals`.
+typedef struct
+{
+    client_t *client;
+    const char *event;
+    void *data;
+    void *locals[SOCKLET_MIDDLEWARE_LOCALS];
+} middleware_context_t;
+
+// Returns false to stop the chain; the handler is then not called.
+typedef bool (*middleware_t)(middleware_context_t *context, void *arg);
+
+typedef struct
+{
+    middleware_t handler;
+    void *arg;
+} middleware_entry_t;
 
 typedef struct
 {
     const char *event_name;
     void (*callback)(client_t *client, void *data);
+    int limit_slot;
+    rate_limit_t limit;
+    middleware_entry_t *middleware;
+    int middleware_count;
+    middleware_entry_t *chain;
+    int chain_length;
 } event_t;
 
+typedef struct
+{
+    _Atomic uint64_t sequence;
+    _Atomic uint32_t lock;
+    uint32_t origin;
+    uint32_t target_kind;
+    uint32_t length;
+    uint64_t target_id;
+    unsigned char frame[SOCKLET_BUS_SLOT_SIZE];
+} bus_slot_t;
+
+typedef struct
+{
+    _Atomic uint32_t magic;
+    uint32_t slot_count;
+    _Atomic uint64_t head;
+    _Atomic uint32_t futex;
+    _Atomic uint32_t waiters;
+    bus_slot_t slots[SOCKLET_BUS_SLOTS];
+} bus_region_t;
+
+typedef struct
+{
+    bus_region_t *region;
+    uint64_t cursor;
+    uint32_t origin;
+    uint64_t dropped;
+    uint64_t stalled_cursor;
+    struct timespec stalled_since;
+    pthread_t thread;
+    atomic_bool running;
+} bus_t;
+
+typedef struct room
+{
+    member_set_t members;
+    uint64_t id;
+    char *name;
+    struct room *next;
+} room_t;
+
+typedef struct topic_node
+{
+    member_set_t members;
+    char *segment;
+    struct topic_node *parent;
+    struct topic_node *children;
+    struct topic_node *sibling;
+} topic_node_t;
+
+typedef struct
+{
+    uint64_t sequence;
+    size_t length;
+    unsigned char *frame;
+    void *buffer;
+} replay_entry_t;
+
+typedef struct
+{
+    replay_entry_t *entries;
+    uint64_t next_sequence;
+    size_t count;
+    size_t bytes;
+} replay_ring_t;
+
+typedef struct session
+{
+    char token[SOCKLET_SESSION_TOKEN_SIZE];
+    client_t *client;
+    time_t detached_at;
+    atomic_int references;
+    pthread_mutex_t lock;
+    replay_ring_t replay;
+    struct session *next;
+    struct session *detached_prev;
+    struct session *detached_next;
+} session_t;
+
+#define DISPATCH_ENVELOPE_FIELDS(FIELD, ARG) \
+    FIELD(ARG, type, JSON_STRING, 20, true) \
+    FIELD(ARG, event, JSON_STRING, 20, false) \
+    FIELD(ARG, data, JSON_STRING, 500, false) \
+    FIELD(ARG, session, JSON_STRING, SOCKLET_SESSION_TOKEN_SIZE, false) \
+    FIELD(ARG, seq, JSON_INT, 0, false)
+
+JSON_SCHEMA(dispatch_envelope_t, dispatch_envelope, DISPATCH_ENVELOPE_FIELDS)
+
 void server_init(server_t *server, void (*callback)(int, char *, client_t *), bool (*authentication_handler)(int, char *));
 void server_listen(server_t *server, int port);
 void server_close(server_t *server);
-void *client_handler(void *arg);
 int websocket_handshake(int client_fd, char *headers_string);
+int websocket_accept(int client_fd, char *request);
 void compute_websocket_accept_key(const char *client_key, char *accept_key);
 void base64_encode(const unsigned char *input, int length, char *output);
 void add_client(client_t *client);
 void remove_client(int client_fd);
 void send_frame(int client_fd, const char *message);
+size_t encode_frame_header(unsigned char *header, unsigned char opcode, size_t payload_length);
+int send_raw_frame(int client_fd, const unsigned char *frame, size_t frame_length);
+unsigned char *encode_json_frame(JsonWriter *writer, unsigned char opcode, size_t *frame_length);
+int send_json(int client_fd, JsonWriter *writer);
 int decode_frame(const unsigned char *input, size_t input_length, char *output, size_t *output_length);
 void register_event(const char *event_name, void (*callback)(client_t *client, void *data));
 void handle_event(client_t *client, void *data);
 void emit_event(const char *event_name, client_t *client, void *data);
+int use_middleware(middleware_t handler, void *arg);
+int use_event_middleware(const char *event_name, middleware_t handler, void *arg);
+int bus_open(bus_t *bus, const char *name);
+int bus_start(bus_t *bus);
+void bus_close(bus_t *bus);
+int bus_publish(bus_t *bus, uint32_t target_kind, uint64_t target_id, const char *message);
+int bus_publish_frame(bus_t *bus, uint32_t target_kind, uint64_t target_id, const unsigned char *frame, size_t frame_length);
+int bus_receive(bus_t *bus, uint32_t *target_kind, uint64_t *target_id, unsigned char *frame, size_t *frame_length, int timeout_ms);
+void bus_deliver(uint32_t target_kind, uint64_t target_id, const unsigned char *frame, size_t frame_length);
+void replay_init(replay_ring_t *ring);
+void replay_push(replay_ring_t *ring, void *buffer, unsigned char *frame, size_t frame_length);
+void replay_free(replay_ring_t *ring);
+session_t *session_create(client_t *client);
+int session_send(client_t *client, const char *message);
+int session_resume(client_t *client, const char *token, uint64_t last_sequence);
+void session_detach(client_t *client);
+void server_set_stream_handler(server_t *server, const stream_handler_t *handler);
+void server_set_connection_memory(server_t *server, size_t bytes);
+void server_set_handoff(server_t *server, const char *path);
+void server_set_cpus(server_t *server, const int *cpus, size_t count, bool steer_incoming_cpu);
+void server_set_loops(server_t *server, size_t count);
+int cpu_pin(int cpu);
+size_t cpu_stats(cpu_stats_t *stats, size_t max);
+void server_set_rate_limit(server_t *server, double rate, uint32_t burst, int action);
+int event_set_rate_limit(const char *event_name, double rate, uint32_t burst, int action);
+void rate_limit_stats(rate_limit_stats_t *stats);
+session_t *session_adopt(client_t *client, const char *token, uint64_t next_sequence);
+void client_stream(client_t *client, const stream_handler_t *handler, void *context);
+void frame_reader_init(frame_reader_t *reader, size_t message_limit);
+int frame_reader_feed(client_t *client, unsigned char *data, size_t length);
+void frame_reader_release(client_t *client);
+void send_close_frame(int client_fd, uint16_t code);
+void utf8_validator_init(utf8_validator_t *validator);
+bool utf8_unmask_validate(utf8_validator_t *validator, unsigned char *data, size_t length, const unsigned char *mask, size_t offset);
+bool utf8_finish(utf8_validator_t *validator);
+bool utf8_validate(const unsigned char *data, size_t length);
+int utf8_set_implementation(int implementation);
+const char *utf8_implementation_name(void);
+uint64_t room_id(const char *name);
+int room_join(client_t *client, const char *name);
+int room_leave(client_t *client, const char *name);
+int room_publish(const char *name, const char *message);
+int room_publish_frame(uint64_t id, const unsigned char *frame, size_t frame_length);
+int topic_subscribe(client_t *client, const char *pattern);
+int topic_unsubscribe(client_t *client, const char *pattern);
+int topic_publish(const char *topic, const char *message);
+void client_leave_all(client_t *client);
+int server_set_recorder(server_t *server, const char *path);
+void trace_record(trace_recorder_t *recorder, uint64_t connection, uint8_t kind, const void *data, size_t length);
+void trace_flush(trace_recorder_t *recorder);
+const trace_record_t *trace_next(const unsigned char *log, size_t log_size, size_t *offset);
+
+extern const stream_handler_t stream_fd_handler;
 
 #ifdef SOCKLET_IMPLEMENTATION
 
 client_t **clients = NULL;
 event_t **events = NULL;
 int client_count = 0;
+int client_capacity = 0;
 int events_count = 0;
+middleware_entry_t *global_middleware = NULL;
+int global_middleware_count = 0;
 pthread_mutex_t client_lock = PTHREAD_MUTEX_INITIALIZER;
+_Atomic uint32_t client_id_counter = 0;
+session_t *sessions[SOCKLET_SESSION_BUCKETS] = {NULL};
+session_t *detached_sessions_head = NULL;
+session_t *detached_sessions_tail = NULL;
+int session_count = 0;
+pthread_mutex_t session_lock = PTHREAD_MUTEX_INITIALIZER;
+client_t **client_slots = NULL;
+client_t **fd_clients = NULL;
+int fd_capacity = 0;
+uint32_t *free_slots = NULL;
+uint32_t slot_capacity = 0;
+uint32_t slot_count = 0;
+uint32_t free_slot_count = 0;
+room_t *rooms[SOCKLET_ROOM_BUCKETS] = {NULL};
+topic_node_t topic_root = {{NULL, 0, 0}, NULL, NULL, NULL, NULL};
+pthread_rwlock_t room_lock = PTHREAD_RWLOCK_INITIALIZER;
+atomic_bool handoff_draining = false;
+_Atomic int64_t handoff_deadline = 0;
+atomic_int active_connections = 0;
+int handoff_connection = -1;
+pthread_mutex_t handoff_lock = PTHREAD_MUTEX_INITIALIZER;
+
+typedef struct
+{
+    _Atomic uint64_t busy_ns;
+    _Atomic uint64_t reads;
+    _Atomic uint64_t bytes;
+    atomic_int connections;
+    atomic_int node;
+    atomic_bool seen;
+} __attribute__((aligned(64))) cpu_counters_t;
+
+cpu_counters_t cpu_counters[SOCKLET_MAX_CPUS];
+int event_table[SOCKLET_EVENT_BUCKETS] = {0};
+int limited_event_count = 0;
+// Set once the loops start. Events and middleware chains are read by the
+// loop threads without locks, so they are frozen from then on.
+atomic_bool loops_running = false;
+_Atomic uint64_t shed_counters[4] = {0};
+
+static int handoff_receive(server_t *server);
+static int handoff_listen(server_t *server);
+static int handoff_start(server_t *server);
+static int handoff_client(client_t *client);
+static void server_start_loops(server_t *server);
+static event_loop_t *loop_for_connection(server_t *server, int client_fd);
+static int loop_enqueue(event_loop_t *loop, int fd, client_t *client);
+static void *pool_lease(buffer_pool_t *pool);
+static void pool_return(buffer_pool_t *pool, void *buffer);
+static void *trace_writer(void *arg);
+static int fd_sendv(int fd, struct iovec *parts, int count);
+static int event_compile(event_t *event);
 
 void server_init(server_t *server, void (*callback)(int, char *, client_t *), bool (*authentication_handler)(int, char *))
 {
     server->server_fd = 0;
     server->callback = callback;
     server->authentication_handler = authentication_handler;
+    server->stream_handler = NULL;
+    server->connection_memory = SOCKLET_CONNECTION_MEMORY;
+    server->handoff_path = NULL;
+    server->handoff_fd = -1;
+    server->handed_off = false;
+    server->cpus = NULL;
+    server->cpu_count = 0;
+    server->steer_incoming_cpu = false;
+    server->loops = NULL;
+    server->loop_count = 0;
+    atomic_init(&server->next_loop, 0);
+    memset(&server->rate_limit, 0, sizeof(server->rate_limit));
+    server->recorder = NULL;
+}
+
+void server_set_handoff(server_t *server, const char *path)
+{
+    server->handoff_path = path;
+}
+
+void server_set_cpus(server_t *server, const int *cpus, size_t count, bool steer_incoming_cpu)
+{
+    server->cpus = cpus;
+    server->cpu_count = count;
+    server->steer_incoming_cpu = steer_incoming_cpu;
+}
+
+void server_set_loops(server_t *server, size_t count)
+{
+    if (!server->cpu_count)
+        server->loop_count = count;
+}
+
+static int current_cpu(void)
+{
+    unsigned int cpu, node;
+    if (syscall(SYS_getcpu, &cpu, &node, NULL) != 0 || cpu >= SOCKLET_MAX_CPUS)
+        return -1;
+    atomic_store_explicit(&cpu_counters[cpu].node, (int)node, memory_order_relaxed);
+    return (int)cpu;
+}
+
+int cpu_pin(int cpu)
+{
+    unsigned long mask[SOCKLET_MAX_CPUS / (8 * sizeof(unsigned long))] = {0};
+    const size_t bits = 8 * sizeof(unsigned long);
+
+    if (cpu < 0 || cpu >= SOCKLET_MAX_CPUS)
+        return -1;
+
+    mask[cpu / bits] |= 1UL << (cpu % bits);
+    if (syscall(SYS_sched_setaffinity, 0, sizeof(mask), mask) != 0)
+    {
+        perror("sched_setaffinity");
+        return -1;
+    }
+
+    // Allocate from the node this thread now runs on, whatever the process
+    // policy is, so connection state first touched here stays local.
+    syscall(SYS_set_mempolicy, MPOL_LOCAL, NULL, 0);
+    current_cpu();
+    return 0;
+}
+
+static void cpu_account(int cpu, size_t bytes, uint64_t busy_ns)
+{
+    cpu_counters_t *counters = &cpu_counters[cpu];
+    atomic_fetch_add_explicit(&counters->reads, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&counters->bytes, bytes, memory_order_relaxed);
+    atomic_fetch_add_explicit(&counters->busy_ns, busy_ns, memory_order_relaxed);
+    if (!atomic_load_explicit(&counters->seen, memory_order_relaxed))
+        atomic_store_explicit(&counters->seen, true, memory_order_relaxed);
+}
+
+size_t cpu_stats(cpu_stats_t *stats, size_t max)
+{
+    size_t count = 0;
+    for (int cpu = 0; cpu < SOCKLET_MAX_CPUS && count < max; cpu++)
+    {
+        cpu_counters_t *counters = &cpu_counters[cpu];
+        if (!atomic_load_explicit(&counters->seen, memory_order_relaxed))
+            continue;
+
+        stats[count].cpu = cpu;
+        stats[count].node = atomic_load_explicit(&counters->node, memory_order_relaxed);
+        stats[count].connections = atomic_load_explicit(&counters->connections, memory_order_relaxed);
+        stats[count].reads = atomic_load_explicit(&counters->reads, memory_order_relaxed);
+        stats[count].bytes = atomic_load_explicit(&counters->bytes, memory_order_relaxed);
+        stats[count].busy_ns = atomic_load_explicit(&counters->busy_ns, memory_order_relaxed);
+        count++;
+    }
+    return count;
+}
+
+void server_set_stream_handler(server_t *server, const stream_handler_t *handler)
+{
+    server->stream_handler = handler;
+}
+
+void server_set_connection_memory(server_t *server, size_t bytes)
+{
+    server->connection_memory = bytes;
 }
 
 void server_listen(server_t *server, int port)
@@ -79,7 +809,16 @@ void server_listen(server_t *server, int port)
     int client_fd;
     struct sockaddr_in client_address;
     socklen_t client_len = sizeof(client_address);
-    pthread_t thread_id;
+
+    server_start_loops(server);
+
+    if (server->handoff_path && handoff_receive(server) == 0)
+    {
+        socklen_t address_length = sizeof(server->address);
+        getsockname(server->server_fd, (struct sockaddr *)&server->address, &address_length);
+        printf("Took over listener on port %d\n", ntohs(server->address.sin_port));
+        goto listening;
+    }
 
     if ((server->server_fd = socket(AF_INET, SOCK_STREAM, 0)) == 0)
     {
@@ -103,7 +842,7 @@ void server_listen(server_t *server, int port)
         exit(EXIT_FAILURE);
     }
 
-    if (listen(server->server_fd, 3) < 0)
+    if (listen(server->server_fd, SOCKLET_LISTEN_BACKLOG) < 0)
     {
         perror("listen");
         exit(EXIT_FAILURE);
@@ -111,35 +850,44 @@ void server_listen(server_t *server, int port)
 
     printf("Listening on port %d\n", port);
 
+listening:
+    if (server->handoff_path)
+        handoff_listen(server);
+
+    struct pollfd fds[2] = {{server->server_fd, POLLIN, 0}, {server->handoff_fd, POLLIN, 0}};
+
     while (1)
     {
-        if ((client_fd = accept(server->server_fd, (struct sockaddr *)&client_address, &client_len)) < 0)
+        if (poll(fds, server->handoff_fd >= 0 ? 2 : 1, -1) < 0)
         {
-            perror("accept");
+            if (errno != EINTR)
+                perror("poll");
             continue;
         }
 
-        printf("New connection from %s:%d\n", inet_ntoa(client_address.sin_addr), ntohs(client_address.sin_port));
+        if (server->handoff_fd >= 0 && (fds[1].revents & POLLIN) && handoff_start(server) == 0)
+        {
+            trace_flush(server->recorder);
+            return;
+        }
+
+        if (!(fds[0].revents & POLLIN))
+            continue;
 
-        client_data_t *client_data = malloc(sizeof(client_data_t));
-        if (client_data == NULL)
+        if ((client_fd = accept(server->server_fd, (struct sockaddr *)&client_address, &client_len)) < 0)
         {
-            perror("Failed to allocate memory for client data");
-            close(client_fd);
+            perror("accept");
             continue;
         }
-        client_data->client_fd = client_fd;
-        client_data->server = server;
 
-        if (pthread_create(&thread_id, NULL, client_handler, client_data) != 0)
+        printf("New connection from %s:%d\n", inet_ntoa(client_address.sin_addr), ntohs(client_address.sin_port));
+        fcntl(client_fd, F_SETFL, fcntl(client_fd, F_GETFL) | O_NONBLOCK);
+
+        atomic_fetch_add(&active_connections, 1);
+        if (loop_enqueue(loop_for_connection(server, client_fd), client_fd, NULL) != 0)
         {
-            perror("Failed to create thread for client");
+            atomic_fetch_sub(&active_connections, 1);
             close(client_fd);
-            free(client_data);
-        }
-        else
-        {
-            pthread_detach(thread_id);
         }
     }
 }
@@ -147,109 +895,164 @@ void server_listen(server_t *server, int port)
 void server_close(server_t *server)
 {
     close(server->server_fd);
-}
-
-void *client_handler(void *arg)
-{
-    char headers[BUFFER_SIZE];
+    trace_flush(server->recorder);
 
-    client_data_t *client_data = (client_data_t *)arg;
-
-    int client_fd = client_data->client_fd;
-    server_t *server = client_data->server;
-
-    free(client_data);
-
-    struct sockaddr_in client_address;
-    socklen_t client_len = sizeof(client_address);
-    getpeername(client_fd, (struct sockaddr *)&client_address, &client_len);
+    if (server->handoff_fd >= 0)
+    {
+        close(server->handoff_fd);
+        server->handoff_fd = -1;
+        if (!server->handed_off)
+            unlink(server->handoff_path);
+    }
+}
 
-    printf("Handling client %s:%d\n", inet_ntoa(client_address.sin_addr), ntohs(client_address.sin_port));
+static int rate_limit_check(client_t *client, size_t length);
+static int rate_limit_check_event(client_t *client, const dispatch_envelope_t *envelope, size_t length);
 
-    char buffer[BUFFER_SIZE] = {0};
+static int64_t monotonic_ms(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
 
-    if (websocket_handshake(client_fd, headers) != 0)
+// Bytes that can be read without running past the end of the current frame,
+// or 0 when the reader sits between messages and the connection can move.
+static size_t frame_reader_wanted(const frame_reader_t *reader)
+{
+    if (reader->header_length < reader->header_needed)
     {
-        close(client_fd);
-        return NULL;
+        if (reader->header_length == 0 && !reader->message_opcode)
+            return 0;
+        return reader->header_needed - reader->header_length;
     }
+    return reader->payload_length - reader->payload_received;
+}
 
-    if (server->authentication_handler(client_fd, headers))
+static int assign_client_slot(client_t *client)
+{
+    if (free_slot_count > 0)
     {
-        printf("Authentication successful for %s:%d\n", inet_ntoa(client_address.sin_addr), ntohs(client_address.sin_port));
+        client->slot = free_slots[--free_slot_count];
     }
     else
     {
-        printf("Authentication failed for %s:%d\n", inet_ntoa(client_address.sin_addr), ntohs(client_address.sin_port));
-        close(client_fd);
-        return NULL;
-    }
-
-    client_t *client = malloc(sizeof(client_t));
-    client->client_fd = client_fd;
-    client->client_address = client_address;
-    client->extra_info = NULL;
-
-    add_client(client);
-
-    server->callback(client_fd, headers, client);
+        if (slot_count == slot_capacity)
+        {
+            uint32_t capacity = slot_capacity ? slot_capacity * 2 : 64;
 
-    while (1)
-    {
-        memset(buffer, 0, BUFFER_SIZE);
-        ssize_t bytes_received = recv(client_fd, buffer, BUFFER_SIZE, 0);
+            // Publishers read client_slots under the room lock only.
+            pthread_rwlock_wrlock(&room_lock);
+            client_t **slots = realloc(client_slots, sizeof(client_t *) * capacity);
+            if (slots)
+                client_slots = slots;
+            pthread_rwlock_unlock(&room_lock);
 
-        if (bytes_received <= 0)
-        {
-            if (bytes_received == 0)
-            {
-                printf("Client disconnected: %s:%d\n",
-                       inet_ntoa(client_address.sin_addr), ntohs(client_address.sin_port));
-            }
-            else
-            {
-                perror("recv failed");
-            }
-            remove_client(client_fd);
-            break;
-        }
-        else
-        {
-            char decoded[BUFFER_SIZE];
-            size_t decoded_length = 0;
+            uint32_t *free_list = realloc(free_slots, sizeof(uint32_t) * capacity);
+            if (free_list)
+                free_slots = free_list;
 
-            if (decode_frame((unsigned char *)buffer, bytes_received, decoded, &decoded_length) == 0)
-            {
-                decoded[decoded_length] = '\0';
-                handle_event(client, decoded);
-            }
-            else
-            {
-                printf("Failed to decode WebSocket frame.\n");
-            }
+            if (!slots || !free_list)
+                return -1;
+            slot_capacity = capacity;
         }
+        client->slot = slot_count++;
     }
 
-    remove_client(client_fd);
-    return NULL;
+    client_slots[client->slot] = client;
+    return 0;
 }
 
 void add_client(client_t *client)
 {
+    pthread_mutex_init(&client->output_lock, NULL);
+
     pthread_mutex_lock(&client_lock);
-    client_t **temp = realloc(clients, sizeof(client_t *) * (client_count + 1));
-    if (!temp)
+    client->index = -1;
+    if (client_count == client_capacity)
+    {
+        int capacity = client_capacity ? client_capacity * 2 : 64;
+        client_t **temp = realloc(clients, sizeof(client_t *) * capacity);
+        if (!temp)
+        {
+            perror("Failed to allocate memory for clients");
+            pthread_mutex_unlock(&client_lock);
+            return;
+        }
+        clients = temp;
+        client_capacity = capacity;
+    }
+    if (assign_client_slot(client) != 0)
     {
         perror("Failed to allocate memory for clients");
         pthread_mutex_unlock(&client_lock);
         return;
     }
-    clients = temp;
+    client->index = client_count;
     clients[client_count++] = client;
+    if (client->client_fd < fd_capacity)
+        fd_clients[client->client_fd] = client;
     printf("Client added. Total clients: %d\n", client_count);
     pthread_mutex_unlock(&client_lock);
 }
 
+// Swap-removes by the client's own index, so removal does not depend on
+// how many clients are connected. A client add_client() failed to register
+// has index -1 and no slot.
+static void remove_client_locked(client_t *client)
+{
+    int index = client->index;
+
+    printf("Removing client %d\n", client->client_fd);
+    if (index >= 0 && client->client_fd < fd_capacity)
+        fd_clients[client->client_fd] = NULL;
+    session_detach(client);
+    client_leave_all(client);
+
+    // Every writer found the client under client_lock, through its session
+    // or through a room it has now left. Taking its output lock waits for
+    // one still inside client_writev(), and closing the output turns the
+    // rest away, so nothing posts it to its loop again.
+    pthread_mutex_lock(&client->output_lock);
+    client->output_closed = true;
+    bool posted = client->flush_posted;
+    pthread_mutex_unlock(&client->output_lock);
+
+    if (posted && client->loop)
+    {
+        pthread_mutex_lock(&client->loop->lock);
+        for (client_t **link = &client->loop->flushes; *link; link = &(*link)->flush_next)
+        {
+            if (*link == client)
+            {
+                *link = client->flush_next;
+                break;
+            }
+        }
+        pthread_mutex_unlock(&client->loop->lock);
+    }
+    free(client->output);
+    pthread_mutex_destroy(&client->output_lock);
+
+    if (index >= 0)
+    {
+        client_slots[client->slot] = NULL;
+        free_slots[free_slot_count++] = client->slot;
+        clients[index] = clients[--client_count];
+        clients[index]->index = index;
+    }
+    close(client->client_fd);
+    free(client);
+}
+
+static void client_remove(client_t *client)
+{
+    pthread_mutex_lock(&client_lock);
+    remove_client_locked(client);
+    printf("Total clients after removal: %d\n", client_count);
+    pthread_mutex_unlock(&client_lock);
+}
+
 void remove_client(int client_fd)
 {
     pthread_mutex_lock(&client_lock);
@@ -257,15 +1060,7 @@ void remove_client(int client_fd)
     {
         if (clients[i]->client_fd == client_fd)
         {
-            printf("Removing client %d\n", client_fd);
-            close(clients[i]->client_fd);
-            free(clients[i]);
-            for (int j = i; j < client_count - 1; j++)
-            {
-                clients[j] = clients[j + 1];
-            }
-            client_count--;
-            clients = realloc(clients, sizeof(client_t *) * client_count);
+            remove_client_locked(clients[i]);
             break;
         }
     }
@@ -273,8 +1068,51 @@ void remove_client(int client_fd)
     pthread_mutex_unlock(&client_lock);
 }
 
+static uint32_t event_hash(const char *name, size_t length)
+{
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++)
+    {
+        hash = (hash ^ (unsigned char)name[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static event_t *event_lookup(const char *name, size_t length)
+{
+    uint32_t bucket = event_hash(name, length);
+    for (int probe = 0; probe < SOCKLET_EVENT_BUCKETS; probe++, bucket++)
+    {
+        int index = event_table[bucket % SOCKLET_EVENT_BUCKETS];
+        if (!index)
+            return NULL;
+
+        event_t *event = events[index - 1];
+        if (strncmp(event->event_name, name, length) == 0 && event->event_name[length] == '\0')
+            return event;
+    }
+    return NULL;
+}
+
 void register_event(const char *event_name, void (*callback)(client_t *client, void *data))
 {
+    if (atomic_load(&loops_running))
+    {
+        fprintf(stderr, "Cannot register event %s after the server has started\n", event_name);
+        return;
+    }
+
+    uint32_t bucket = event_hash(event_name, strlen(event_name)) % SOCKLET_EVENT_BUCKETS;
+    for (int probe = 0; event_table[bucket]; probe++)
+    {
+        if (probe == SOCKLET_EVENT_BUCKETS)
+        {
+            fprintf(stderr, "Too many events to register %s\n", event_name);
+            return;
+        }
+        bucket = (bucket + 1) % SOCKLET_EVENT_BUCKETS;
+    }
+
     event_t **temp = realloc(events, sizeof(event_t *) * (events_count + 1));
     if (!temp)
     {
@@ -286,50 +1124,147 @@ void register_event(const char *event_name, void (*callback)(client_t *client, v
     event_t *event = malloc(sizeof(event_t));
     event->event_name = event_name;
     event->callback = callback;
+    event->limit_slot = -1;
+    memset(&event->limit, 0, sizeof(event->limit));
+    event->middleware = NULL;
+    event->middleware_count = 0;
+    event->chain = NULL;
+    event->chain_length = 0;
+    event_compile(event);
 
     events[events_count++] = event;
+    event_table[bucket] = events_count;
 }
 
-void handle_event(client_t *client, void *data)
+// Flattens the global middleware followed by the event's own into one array,
+// so dispatch walks it without lookups. Chains are rebuilt whenever
+// middleware is added, which is refused once the loops are running.
+static int event_compile(event_t *event)
 {
-    char type[BUFFER_SIZE];
-    char event[BUFFER_SIZE];
-    char client_data[BUFFER_SIZE] = {0};
-    char *error = NULL;
+    int length = global_middleware_count + event->middleware_count;
+    middleware_entry_t *chain = NULL;
 
-    JsonMap mappings[] = {
-        {"type", &type, 's', 20, true, NULL},
-        {"event", &event, 's', 20, true, NULL},
-        {"data", &client_data, 's', 500, false, NULL}
-    };
-
-    if(parse_json(data, mappings, 3, &error))
+    if (length > 0)
     {
-        if(strcmp(type, "socklet:dispatch") == 0)
-        {
-            emit_event(event, client, client_data);
-        }
-        else
+        chain = malloc(sizeof(middleware_entry_t) * length);
+        if (!chain)
         {
-            printf("Invalid message type: %s\n", type);
+            perror("Failed to allocate middleware chain");
+            return -1;
         }
+        if (global_middleware_count > 0)
+            memcpy(chain, global_middleware, sizeof(middleware_entry_t) * global_middleware_count);
+        if (event->middleware_count > 0)
+            memcpy(chain + global_middleware_count, event->middleware, sizeof(middleware_entry_t) * event->middleware_count);
+    }
+
+    free(event->chain);
+    event->chain = chain;
+    event->chain_length = length;
+    return 0;
+}
+
+static int middleware_append(middleware_entry_t **list, int *count, middleware_t handler, void *arg)
+{
+    middleware_entry_t *temp = realloc(*list, sizeof(middleware_entry_t) * (*count + 1));
+    if (!temp)
+    {
+        perror("Failed to allocate middleware");
+        return -1;
+    }
+    temp[*count].handler = handler;
+    temp[*count].arg = arg;
+    *list = temp;
+    (*count)++;
+    return 0;
+}
+
+int use_middleware(middleware_t handler, void *arg)
+{
+    if (atomic_load(&loops_running))
+    {
+        fprintf(stderr, "Cannot add middleware after the server has started\n");
+        return -1;
+    }
+
+    if (middleware_append(&global_middleware, &global_middleware_count, handler, arg) != 0)
+        return -1;
+
+    int result = 0;
+    for (int i = 0; i < events_count; i++)
+    {
+        if (event_compile(events[i]) != 0)
+            result = -1;
+    }
+    return result;
+}
+
+int use_event_middleware(const char *event_name, middleware_t handler, void *arg)
+{
+    if (atomic_load(&loops_running))
+    {
+        fprintf(stderr, "Cannot add middleware to %s after the server has started\n", event_name);
+        return -1;
+    }
+
+    event_t *event = event_lookup(event_name, strlen(event_name));
+    if (!event)
+    {
+        fprintf(stderr, "Cannot add middleware to unregistered event %s\n", event_name);
+        return -1;
+    }
+
+    if (middleware_append(&event->middleware, &event->middleware_count, handler, arg) != 0)
+        return -1;
+    return event_compile(event);
+}
+
+static void handle_envelope(client_t *client, dispatch_envelope_t *envelope)
+{
+    if(strcmp(envelope->type, "socklet:dispatch") == 0 && envelope->event[0])
+    {
+        emit_event(envelope->event, client, envelope->data);
+    }
+    else if(strcmp(envelope->type, "socklet:resume") == 0 && envelope->session[0] && envelope->seq >= 0)
+    {
+        session_resume(client, envelope->session, envelope->seq);
     }
     else
     {
-        printf("Failed to parse JSON: %s\n", error);
+        printf("Invalid message type: %s\n", envelope->type);
     }
 }
 
+void handle_event(client_t *client, void *data)
+{
+    dispatch_envelope_t envelope;
+    char *error = NULL;
+
+    if(dispatch_envelope_parse(data, &envelope, &error))
+        handle_envelope(client, &envelope);
+    else
+        printf("Failed to parse JSON: %s\n", error);
+}
+
 void emit_event(const char *event_name, client_t *client, void *data)
 {
-    for (int i = 0; i < events_count; i++)
+    event_t *event = event_lookup(event_name, strlen(event_name));
+    if (!event)
+        return;
+
+    if (event->chain_length == 0)
     {
-        if (strcmp(events[i]->event_name, event_name) == 0)
-        {
-            events[i]->callback(client, data);
-            break;
-        }
+        event->callback(client, data);
+        return;
     }
+
+    middleware_context_t context = {client, event->event_name, data, {NULL}};
+    for (int i = 0; i < event->chain_length; i++)
+    {
+        if (!event->chain[i].handler(&context, event->chain[i].arg))
+            return;
+    }
+    event->callback(client, context.data);
 }
 
 int websocket_handshake(int client_fd, char *headers_string)
@@ -344,8 +1279,18 @@ int websocket_handshake(int client_fd, char *headers_string)
 
     buffer[bytes_received] = '\0';
 
-    char *headers_start = buffer;
-    char *headers_end = strstr(headers_start, "\r\n\r\n");
+    if (websocket_accept(client_fd, buffer) != 0)
+        return -1;
+
+    strcpy(headers_string, buffer);
+    return 0;
+}
+
+// Answers a complete upgrade request held in `request` and truncates it to
+// the header block, which is what the authentication handler receives.
+int websocket_accept(int client_fd, char *request)
+{
+    char *headers_end = strstr(request, "\r\n\r\n");
 
     if (!headers_end)
     {
@@ -353,12 +1298,9 @@ int websocket_handshake(int client_fd, char *headers_string)
         return -1;
     }
 
-    size_t headers_length = headers_end - headers_start;
-
-    strncpy(headers_string, headers_start, headers_length);
-    headers_string[headers_length] = '\0';
+    *headers_end = '\0';
 
-    char *key_start = strstr(buffer, "Sec-WebSocket-Key: ");
+    char *key_start = strstr(request, "Sec-WebSocket-Key: ");
     if (!key_start)
     {
         printf("Missing Sec-WebSocket-Key in request\n");
@@ -367,20 +1309,22 @@ int websocket_handshake(int client_fd, char *headers_string)
 
     key_start += strlen("Sec-WebSocket-Key: ");
 
-    char *key_end = strstr(key_start, "\r\n");
-    if (!key_end)
+    // The request is cut at the blank line, so the key may be the last line.
+    char client_key[256];
+    size_t key_length = strcspn(key_start, "\r\n");
+    if (key_length == 0 || key_length >= sizeof(client_key))
     {
         printf("Invalid Sec-WebSocket-Key format\n");
         return -1;
     }
 
-    char client_key[256];
-    strncpy(client_key, key_start, key_end - key_start);
-    client_key[key_end - key_start] = '\0';
+    memcpy(client_key, key_start, key_length);
+    client_key[key_length] = '\0';
 
     char accept_key[256];
     compute_websocket_accept_key(client_key, accept_key);
 
+    char buffer[BUFFER_SIZE];
     snprintf(buffer, sizeof(buffer),
              "HTTP/1.1 101 Switching Protocols\r\n"
              "Upgrade: websocket\r\n"
@@ -388,7 +1332,8 @@ int websocket_handshake(int client_fd, char *headers_string)
              "Sec-WebSocket-Accept: %s\r\n\r\n",
              accept_key);
 
-    if (send(client_fd, buffer, strlen(buffer), 0) < 0)
+    struct iovec response = {buffer, strlen(buffer)};
+    if (fd_sendv(client_fd, &response, 1) != 0)
     {
         perror("Failed to send handshake response");
         return -1;
@@ -400,7 +1345,7 @@ int websocket_handshake(int client_fd, char *headers_string)
 void compute_websocket_accept_key(const char *client_key, char *accept_key)
 {
     const char *GUID = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
-    char combined[256];
+    char combined[320];
     unsigned char sha1_hash[SHA_DIGEST_LENGTH];
 
     snprintf(combined, sizeof(combined), "%s%s", client_key, GUID);
@@ -425,43 +1370,340 @@ void base64_encode(const unsigned char *input, int length, char *output)
     BIO_free_all(b64);
 }
 
-void send_frame(int client_fd, const char *message)
+size_t encode_frame_header(unsigned char *header, unsigned char opcode, size_t payload_length)
 {
-    unsigned char frame[10];
-    size_t message_len = strlen(message);
-    int frame_len = 0;
+    header[0] = 0x80 | (opcode & 0x0F);
 
-    frame[0] = 0x81;
+    if (payload_length <= 125)
+    {
+        header[1] = payload_length;
+        return 2;
+    }
+
+    if (payload_length <= 65535)
+    {
+        header[1] = 126;
+        header[2] = (payload_length >> 8) & 0xFF;
+        header[3] = payload_length & 0xFF;
+        return 4;
+    }
+
+    header[1] = 127;
+    for (int i = 0; i < 8; i++)
+    {
+        header[2 + i] = ((uint64_t)payload_length >> (56 - 8 * i)) & 0xFF;
+    }
+    return 10;
+}
+
+// Client sockets are non-blocking and no write ever waits for a slow
+// reader. Whatever the kernel does not take at once is queued on the client,
+// up to SOCKLET_OUTPUT_LIMIT, and written by the client's loop once the
+// socket is writable. Only the owning loop writes directly, and only while
+// nothing is queued, so frames never interleave or tear. Other threads, and
+// anything holding a global lock, only queue and post the client to its loop.
+static _Thread_local event_loop_t *loop_current = NULL;
+
+// Called with client_lock held.
+static client_t *client_for_fd(int fd)
+{
+    if (fd < 0 || fd >= fd_capacity)
+        return NULL;
+    return fd_clients[fd];
+}
+
+static void loop_post(event_loop_t *loop, client_t *client)
+{
+    pthread_mutex_lock(&loop->lock);
+    bool wake = !loop->flushes && loop != loop_current;
+    client->flush_next = loop->flushes;
+    loop->flushes = client;
+    pthread_mutex_unlock(&loop->lock);
+
+    uint64_t wake_value = 1;
+    if (wake && write(loop->wake_fd, &wake_value, sizeof(wake_value)) != sizeof(wake_value))
+        perror("loop wake");
+}
+
+static int output_reserve(client_t *client, size_t length)
+{
+    if (client->output_offset + client->output_length + length <= client->output_capacity)
+        return 0;
+
+    if (client->output_offset > 0)
+    {
+        memmove(client->output, client->output + client->output_offset, client->output_length);
+        client->output_offset = 0;
+        if (client->output_length + length <= client->output_capacity)
+            return 0;
+    }
+
+    size_t capacity = client->output_capacity ? client->output_capacity : SOCKLET_POOL_BLOCK_SIZE;
+    while (capacity < client->output_length + length)
+        capacity *= 2;
+    unsigned char *output = realloc(client->output, capacity);
+    if (!output)
+        return -1;
+    client->output = output;
+    client->output_capacity = capacity;
+    return 0;
+}
+
+// Called with the client's output_lock held, which it releases. `direct`
+// allows writing to the socket when called on the client's own loop;
+// callers that hold client_lock, room_lock or a session lock for other
+// clients pass false and only queue.
+static int client_writev_locked(client_t *client, const struct iovec *parts, int count, bool direct)
+{
+    size_t length = 0;
+    for (int i = 0; i < count; i++)
+    {
+        length += parts[i].iov_len;
+    }
+
+    if (client->output_closed)
+    {
+        pthread_mutex_unlock(&client->output_lock);
+        return -1;
+    }
 
-    if (message_len <= 125)
+    size_t sent = 0;
+    if (direct && client->output_length == 0 && client->loop && client->loop == loop_current)
     {
-        frame[1] = message_len;
-        frame_len = 2;
+        struct msghdr message = {0};
+        message.msg_iov = (struct iovec *)parts;
+        message.msg_iovlen = count;
+        ssize_t result;
+        while ((result = sendmsg(client->client_fd, &message, MSG_NOSIGNAL | MSG_DONTWAIT)) < 0 && errno == EINTR)
+        {
+        }
+        if (result < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+        {
+            // The peer is gone; reading notices and closes the connection.
+            client->output_closed = true;
+            pthread_mutex_unlock(&client->output_lock);
+            return -1;
+        }
+        sent = result > 0 ? (size_t)result : 0;
+        if (sent == length)
+        {
+            pthread_mutex_unlock(&client->output_lock);
+            return 0;
+        }
     }
-    else if (message_len <= 65535)
+
+    size_t remaining = length - sent;
+    if (client->output_length + remaining > SOCKLET_OUTPUT_LIMIT || output_reserve(client, remaining) != 0)
     {
-        frame[1] = 126;
-        frame[2] = (message_len >> 8) & 0xFF;
-        frame[3] = message_len & 0xFF;
-        frame_len = 4;
+        // A reader this far behind is dropped rather than buffered without
+        // bound; its loop closes the connection.
+        fprintf(stderr, "Closing client %d: output queue over %d bytes\n", client->client_fd, SOCKLET_OUTPUT_LIMIT);
+        client->output_closed = true;
+        client->output_failed = true;
     }
     else
     {
-        frame[1] = 127;
-        frame[2] = (message_len >> 56) & 0xFF;
-        frame[3] = (message_len >> 48) & 0xFF;
-        frame[4] = (message_len >> 40) & 0xFF;
-        frame[5] = (message_len >> 32) & 0xFF;
-        frame[6] = (message_len >> 24) & 0xFF;
-        frame[7] = (message_len >> 16) & 0xFF;
-        frame[8] = (message_len >> 8) & 0xFF;
-        frame[9] = message_len & 0xFF;
-        frame_len = 10;
+        unsigned char *out = client->output + client->output_offset + client->output_length;
+        size_t skip = sent;
+        for (int i = 0; i < count; i++)
+        {
+            if (skip >= parts[i].iov_len)
+            {
+                skip -= parts[i].iov_len;
+                continue;
+            }
+            memcpy(out, (const unsigned char *)parts[i].iov_base + skip, parts[i].iov_len - skip);
+            out += parts[i].iov_len - skip;
+            skip = 0;
+        }
+        client->output_length += remaining;
+    }
+
+    // A client adopted through a hot restart has no loop until its loop
+    // takes it over, which then picks up anything already queued. Posting
+    // under the output lock keeps removal from missing the post.
+    if (client->loop && !client->flush_posted)
+    {
+        client->flush_posted = true;
+        loop_post(client->loop, client);
+    }
+    bool failed = client->output_failed;
+    pthread_mutex_unlock(&client->output_lock);
+    return failed ? -1 : 0;
+}
+
+static int client_writev(client_t *client, const struct iovec *parts, int count, bool direct)
+{
+    pthread_mutex_lock(&client->output_lock);
+    return client_writev_locked(client, parts, count, direct);
+}
+
+static int client_send(client_t *client, const unsigned char *frame, size_t frame_length)
+{
+    struct iovec part = {(void *)frame, frame_length};
+    return client_writev(client, &part, 1, true);
+}
+
+static int client_queue(client_t *client, const unsigned char *frame, size_t frame_length)
+{
+    struct iovec part = {(void *)frame, frame_length};
+    return client_writev(client, &part, 1, false);
+}
+
+// Writes as much of the queue as the socket takes, on the client's loop.
+// Returns the number of bytes still queued, or -1 if the connection has to
+// be closed.
+static ssize_t client_flush(client_t *client)
+{
+    pthread_mutex_lock(&client->output_lock);
+    while (client->output_length > 0 && !client->output_failed)
+    {
+        ssize_t result = send(client->client_fd, client->output + client->output_offset, client->output_length, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (result < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            client->output_closed = true;
+            client->output_failed = true;
+            break;
+        }
+        client->output_offset += result;
+        client->output_length -= result;
+    }
+
+    // Idle connections keep no output buffer.
+    if (client->output_length == 0 || client->output_failed)
+    {
+        free(client->output);
+        client->output = NULL;
+        client->output_offset = 0;
+        client->output_length = 0;
+        client->output_capacity = 0;
+    }
+
+    ssize_t queued = client->output_failed ? -1 : (ssize_t)client->output_length;
+    pthread_mutex_unlock(&client->output_lock);
+    return queued;
+}
+
+// Descriptors without a registered client, such as a connection that is
+// still upgrading, are written directly. A non-blocking one that cannot take
+// everything at once fails.
+static int fd_sendv(int fd, struct iovec *parts, int count)
+{
+    struct msghdr message = {0};
+    message.msg_iov = parts;
+    message.msg_iovlen = count;
+
+    while (message.msg_iovlen > 0)
+    {
+        ssize_t result = sendmsg(fd, &message, MSG_NOSIGNAL);
+        if (result < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        while (message.msg_iovlen > 0 && (size_t)result >= message.msg_iov->iov_len)
+        {
+            result -= message.msg_iov->iov_len;
+            message.msg_iov++;
+            message.msg_iovlen--;
+        }
+        if (message.msg_iovlen > 0)
+        {
+            message.msg_iov->iov_base = (unsigned char *)message.msg_iov->iov_base + result;
+            message.msg_iov->iov_len -= result;
+        }
+    }
+    return 0;
+}
+
+// The fd-based sends may be called from any thread. The client is looked up
+// under client_lock and its output lock taken before that is released, so
+// it cannot be freed in between; the send itself happens outside the lock.
+static int fd_writev(int client_fd, struct iovec *parts, int count)
+{
+    pthread_mutex_lock(&client_lock);
+    client_t *client = client_for_fd(client_fd);
+    if (!client)
+    {
+        pthread_mutex_unlock(&client_lock);
+        return fd_sendv(client_fd, parts, count);
+    }
+
+    pthread_mutex_lock(&client->output_lock);
+    pthread_mutex_unlock(&client_lock);
+    return client_writev_locked(client, parts, count, true);
+}
+
+void send_frame(int client_fd, const char *message)
+{
+    unsigned char frame[10];
+    size_t message_len = strlen(message);
+    size_t frame_len = encode_frame_header(frame, 0x1, message_len);
+    struct iovec parts[2] = {{frame, frame_len}, {(void *)message, message_len}};
+
+    fd_writev(client_fd, parts, 2);
+}
+
+int send_raw_frame(int client_fd, const unsigned char *frame, size_t frame_length)
+{
+    struct iovec part = {(void *)frame, frame_length};
+
+    return fd_writev(client_fd, &part, 1);
+}
+
+unsigned char *encode_json_frame(JsonWriter *writer, unsigned char opcode, size_t *frame_length)
+{
+    unsigned char header[10];
+    size_t header_length = encode_frame_header(header, opcode, writer->length);
+
+    if (writer->overflow || writer->reserve < header_length)
+        return NULL;
+
+    unsigned char *frame = (unsigned char *)json_writer_data(writer) - header_length;
+    memcpy(frame, header, header_length);
+    *frame_length = header_length + writer->length;
+    return frame;
+}
+
+int send_json(int client_fd, JsonWriter *writer)
+{
+    size_t frame_length;
+    unsigned char *frame = encode_json_frame(writer, 0x1, &frame_length);
+    if (!frame)
+        return -1;
+
+    return send_raw_frame(client_fd, frame, frame_length);
+}
+
+static void unmask_payload(unsigned char *data, size_t length, const unsigned char mask[4], size_t offset)
+{
+    unsigned char key[8];
+    for (int i = 0; i < 8; i++)
+    {
+        key[i] = mask[(offset + i) % 4];
     }
 
-    send(client_fd, frame, frame_len, 0);
+    uint64_t key_word;
+    memcpy(&key_word, key, sizeof(key_word));
 
-    send(client_fd, message, message_len, 0);
+    size_t i = 0;
+    for (; i + 8 <= length; i += 8)
+    {
+        uint64_t word;
+        memcpy(&word, data + i, sizeof(word));
+        word ^= key_word;
+        memcpy(data + i, &word, sizeof(word));
+    }
+    for (; i < length; i++)
+    {
+        data[i] ^= key[i % 8];
+    }
 }
 
 int decode_frame(const unsigned char *input, size_t input_length, char *output, size_t *output_length)
@@ -525,15 +1767,3591 @@ int decode_frame(const unsigned char *input, size_t input_length, char *output,
     memcpy(masking_key, input + pos, 4);
     pos += 4;
 
-    for (uint64_t i = 0; i < payload_length; i++)
-    {
-        output[i] = input[pos + i] ^ masking_key[i % 4];
-    }
+    memcpy(output, input + pos, payload_length);
+
+    if (opcode == 0x1)
+    {
+        utf8_validator_t validator;
+        utf8_validator_init(&validator);
+        utf8_unmask_validate(&validator, (unsigned char *)output, payload_length, masking_key, 0);
+        if (!utf8_finish(&validator))
+        {
+            fprintf(stderr, "Invalid WebSocket frame: text payload is not valid UTF-8.\n");
+            return -1;
+        }
+    }
+    else
+    {
+        unmask_payload((unsigned char *)output, payload_length, masking_key, 0);
+    }
 
     *output_length = payload_length;
     return 0;
 }
 
+static long bus_futex(_Atomic uint32_t *address, int operation, uint32_t value, const struct timespec *timeout)
+{
+    return syscall(SYS_futex, (uint32_t *)address, operation, value, timeout, NULL, 0);
+}
+
+int bus_open(bus_t *bus, const char *name)
+{
+    memset(bus, 0, sizeof(*bus));
+    bus->origin = (uint32_t)getpid();
+
+    bool created = true;
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0 && errno == EEXIST)
+    {
+        created = false;
+        fd = shm_open(name, O_RDWR, 0600);
+    }
+    if (fd < 0)
+    {
+        perror("shm_open");
+        return -1;
+    }
+
+    if (created && ftruncate(fd, sizeof(bus_region_t)) < 0)
+    {
+        perror("ftruncate");
+        close(fd);
+        shm_unlink(name);
+        return -1;
+    }
+
+    // Another process may still be sizing a region it just created.
+    struct stat info;
+    for (int attempt = 0; !created; attempt++)
+    {
+        if (fstat(fd, &info) == 0 && (size_t)info.st_size >= sizeof(bus_region_t))
+            break;
+        if (attempt == 100)
+        {
+            fprintf(stderr, "Bus region %s has an unexpected size\n", name);
+            close(fd);
+            return -1;
+        }
+        usleep(1000);
+    }
+
+    bus_region_t *region = mmap(NULL, sizeof(bus_region_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (region == MAP_FAILED)
+    {
+        perror("mmap");
+        return -1;
+    }
+
+    if (created)
+    {
+        region->slot_count = SOCKLET_BUS_SLOTS;
+        atomic_store_explicit(&region->magic, SOCKLET_BUS_MAGIC, memory_order_release);
+    }
+    else
+    {
+        for (int attempt = 0; atomic_load_explicit(&region->magic, memory_order_acquire) != SOCKLET_BUS_MAGIC; attempt++)
+        {
+            if (attempt == 100)
+            {
+                fprintf(stderr, "Bus region %s was never initialized\n", name);
+                munmap(region, sizeof(bus_region_t));
+                return -1;
+            }
+            usleep(1000);
+        }
+
+        if (region->slot_count != SOCKLET_BUS_SLOTS)
+        {
+            fprintf(stderr, "Bus region %s uses %u slots, expected %d\n", name, region->slot_count, SOCKLET_BUS_SLOTS);
+            munmap(region, sizeof(bus_region_t));
+            return -1;
+        }
+    }
+
+    bus->region = region;
+    bus->cursor = atomic_load_explicit(&region->head, memory_order_acquire);
+    return 0;
+}
+
+int bus_publish_frame(bus_t *bus, uint32_t target_kind, uint64_t target_id, const unsigned char *frame, size_t frame_length)
+{
+    if (frame_length > SOCKLET_BUS_SLOT_SIZE)
+    {
+        fprintf(stderr, "Bus frame of %zu bytes exceeds the slot size\n", frame_length);
+        return -1;
+    }
+    if (!bus->region)
+        return -1;
+
+    bus_region_t *region = bus->region;
+    uint64_t ticket = atomic_fetch_add_explicit(&region->head, 1, memory_order_acq_rel);
+    bus_slot_t *slot = &region->slots[ticket % SOCKLET_BUS_SLOTS];
+
+    // Writers only contend on a slot when one of them has been lapped by a
+    // whole ring; the lock is stolen if its holder appears to have died.
+    uint32_t unlocked = 0;
+    for (int spins = 0; !atomic_compare_exchange_weak_explicit(&slot->lock, &unlocked, 1, memory_order_acquire, memory_order_relaxed); spins++)
+    {
+        unlocked = 0;
+        if (spins > 100000)
+        {
+            atomic_exchange_explicit(&slot->lock, 1, memory_order_acquire);
+            break;
+        }
+        sched_yield();
+    }
+
+    if (atomic_load_explicit(&slot->sequence, memory_order_relaxed) > ticket + 1)
+    {
+        atomic_store_explicit(&slot->lock, 0, memory_order_release);
+        return -1;
+    }
+
+    atomic_store_explicit(&slot->sequence, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    slot->origin = bus->origin;
+    slot->target_kind = target_kind;
+    slot->target_id = target_id;
+    slot->length = frame_length;
+    memcpy(slot->frame, frame, frame_length);
+
+    atomic_store_explicit(&slot->sequence, ticket + 1, memory_order_release);
+    atomic_store_explicit(&slot->lock, 0, memory_order_release);
+
+    atomic_fetch_add_explicit(&region->futex, 1, memory_order_release);
+    if (atomic_load_explicit(&region->waiters, memory_order_acquire) > 0)
+    {
+        bus_futex(&region->futex, FUTEX_WAKE, INT_MAX, NULL);
+    }
+
+    return 0;
+}
+
+int bus_publish(bus_t *bus, uint32_t target_kind, uint64_t target_id, const char *message)
+{
+    size_t message_length = strlen(message);
+    if (message_length + 10 > SOCKLET_BUS_SLOT_SIZE)
+    {
+        fprintf(stderr, "Bus message of %zu bytes exceeds the slot size\n", message_length);
+        return -1;
+    }
+
+    unsigned char frame[SOCKLET_BUS_SLOT_SIZE];
+    size_t header_length = encode_frame_header(frame, 0x1, message_length);
+    memcpy(frame + header_length, message, message_length);
+
+    // Local clients are reached even when the bus never opened.
+    bus_deliver(target_kind, target_id, frame, header_length + message_length);
+    if (!bus->region)
+        return -1;
+    return bus_publish_frame(bus, target_kind, target_id, frame, header_length + message_length);
+}
+
+int bus_receive(bus_t *bus, uint32_t *target_kind, uint64_t *target_id, unsigned char *frame, size_t *frame_length, int timeout_ms)
+{
+    bus_region_t *region = bus->region;
+    struct timespec started;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+
+    while (1)
+    {
+        uint32_t futex_value = atomic_load_explicit(&region->futex, memory_order_acquire);
+        uint64_t head = atomic_load_explicit(&region->head, memory_order_acquire);
+
+        if (head - bus->cursor > SOCKLET_BUS_SLOTS)
+        {
+            bus->dropped += head - bus->cursor - SOCKLET_BUS_SLOTS;
+            bus->cursor = head - SOCKLET_BUS_SLOTS;
+        }
+
+        if (bus->cursor < head)
+        {
+            bus_slot_t *slot = &region->slots[bus->cursor % SOCKLET_BUS_SLOTS];
+            uint64_t expected = bus->cursor + 1;
+            uint64_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+
+            if (sequence == expected)
+            {
+                uint32_t origin = slot->origin;
+                uint32_t kind = slot->target_kind;
+                uint64_t target = slot->target_id;
+                size_t length = slot->length;
+                if (length > SOCKLET_BUS_SLOT_SIZE)
+                    length = SOCKLET_BUS_SLOT_SIZE;
+                memcpy(frame, slot->frame, length);
+
+                // Seqlock check: the slot must not have been rewritten while copying.
+                atomic_thread_fence(memory_order_acquire);
+                bus->cursor++;
+                if (atomic_load_explicit(&slot->sequence, memory_order_relaxed) != expected)
+                {
+                    bus->dropped++;
+                    continue;
+                }
+
+                if (origin == bus->origin)
+                    continue;
+
+                *target_kind = kind;
+                *target_id = target;
+                *frame_length = length;
+                return 1;
+            }
+
+            if (sequence > expected)
+            {
+                bus->dropped++;
+                bus->cursor++;
+                continue;
+            }
+        }
+
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        // A slot that stays claimed but unpublished belongs to a producer
+        // that died mid-write; skip it rather than stalling the bus forever.
+        if (bus->cursor < head)
+        {
+            if (bus->stalled_cursor != bus->cursor + 1)
+            {
+                bus->stalled_cursor = bus->cursor + 1;
+                bus->stalled_since = now;
+            }
+            else if ((now.tv_sec - bus->stalled_since.tv_sec) * 1000 + (now.tv_nsec - bus->stalled_since.tv_nsec) / 1000000 >= SOCKLET_BUS_STALL_MS)
+            {
+                bus->dropped++;
+                bus->cursor++;
+                continue;
+            }
+        }
+
+        long elapsed_ms = (now.tv_sec - started.tv_sec) * 1000 + (now.tv_nsec - started.tv_nsec) / 1000000;
+        if (elapsed_ms >= timeout_ms)
+        {
+            return 0;
+        }
+
+        long remaining_ms = timeout_ms - elapsed_ms;
+        if (bus->cursor < head && remaining_ms > 10)
+        {
+            remaining_ms = 10;
+        }
+        struct timespec timeout = {remaining_ms / 1000, (remaining_ms % 1000) * 1000000};
+
+        atomic_fetch_add_explicit(&region->waiters, 1, memory_order_acq_rel);
+        bus_futex(&region->futex, FUTEX_WAIT, futex_value, &timeout);
+        atomic_fetch_sub_explicit(&region->waiters, 1, memory_order_acq_rel);
+    }
+}
+
+void bus_deliver(uint32_t target_kind, uint64_t target_id, const unsigned char *frame, size_t frame_length)
+{
+    if (target_kind == SOCKLET_BUS_ROOM)
+    {
+        room_publish_frame(target_id, frame, frame_length);
+        return;
+    }
+
+    pthread_mutex_lock(&client_lock);
+    for (int i = 0; i < client_count; i++)
+    {
+        if (target_kind == SOCKLET_BUS_BROADCAST)
+        {
+            client_queue(clients[i], frame, frame_length);
+        }
+        else if (target_kind == SOCKLET_BUS_CLIENT && clients[i]->id == target_id)
+        {
+            client_queue(clients[i], frame, frame_length);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&client_lock);
+}
+
+static void *bus_thread(void *arg)
+{
+    bus_t *bus = (bus_t *)arg;
+    unsigned char *frame = malloc(SOCKLET_BUS_SLOT_SIZE);
+    if (!frame)
+    {
+        perror("Failed to allocate bus frame");
+        return NULL;
+    }
+
+    while (atomic_load(&bus->running))
+    {
+        uint32_t target_kind;
+        uint64_t target_id;
+        size_t frame_length;
+
+        if (bus_receive(bus, &target_kind, &target_id, frame, &frame_length, 100) == 1)
+        {
+            bus_deliver(target_kind, target_id, frame, frame_length);
+        }
+    }
+
+    free(frame);
+    return NULL;
+}
+
+int bus_start(bus_t *bus)
+{
+    if (!bus->region)
+        return -1;
+
+    atomic_store(&bus->running, true);
+    if (pthread_create(&bus->thread, NULL, bus_thread, bus) != 0)
+    {
+        perror("Failed to create bus thread");
+        atomic_store(&bus->running, false);
+        return -1;
+    }
+    return 0;
+}
+
+void bus_close(bus_t *bus)
+{
+    if (atomic_exchange(&bus->running, false))
+    {
+        pthread_join(bus->thread, NULL);
+    }
+
+    if (bus->region)
+    {
+        munmap(bus->region, sizeof(bus_region_t));
+        bus->region = NULL;
+    }
+}
+
+void replay_init(replay_ring_t *ring)
+{
+    memset(ring, 0, sizeof(*ring));
+    ring->next_sequence = 1;
+}
+
+static void replay_evict_oldest(replay_ring_t *ring)
+{
+    replay_entry_t *entry = &ring->entries[(ring->next_sequence - ring->count) % SOCKLET_REPLAY_CAPACITY];
+    ring->bytes -= entry->length;
+    free(entry->buffer);
+    entry->buffer = NULL;
+    entry->frame = NULL;
+    ring->count--;
+}
+
+void replay_push(replay_ring_t *ring, void *buffer, unsigned char *frame, size_t frame_length)
+{
+    while (ring->count > 0 && (ring->count == SOCKLET_REPLAY_CAPACITY || ring->bytes + frame_length > SOCKLET_REPLAY_MAX_BYTES))
+    {
+        replay_evict_oldest(ring);
+    }
+
+    uint64_t sequence = ring->next_sequence++;
+
+    // A frame larger than the whole budget is sent but never retained, so
+    // a client that missed it will be asked to resync.
+    if (frame_length > SOCKLET_REPLAY_MAX_BYTES)
+    {
+        free(buffer);
+        return;
+    }
+
+    // Idle sessions never pay for the ring; it is allocated on first use.
+    if (!ring->entries && !(ring->entries = calloc(SOCKLET_REPLAY_CAPACITY, sizeof(replay_entry_t))))
+    {
+        free(buffer);
+        return;
+    }
+
+    replay_entry_t *entry = &ring->entries[sequence % SOCKLET_REPLAY_CAPACITY];
+    entry->sequence = sequence;
+    entry->length = frame_length;
+    entry->frame = frame;
+    entry->buffer = buffer;
+    ring->count++;
+    ring->bytes += frame_length;
+}
+
+void replay_free(replay_ring_t *ring)
+{
+    while (ring->count > 0)
+    {
+        replay_evict_oldest(ring);
+    }
+    free(ring->entries);
+    ring->entries = NULL;
+}
+
+static unsigned char *session_build_frame(uint64_t sequence, const char *message, void **buffer, size_t *frame_length)
+{
+    size_t message_length = strlen(message);
+    size_t capacity = 10 + 64 + message_length * 6;
+
+    *buffer = malloc(capacity);
+    if (!*buffer)
+        return NULL;
+
+    JsonWriter writer;
+    json_writer_init(&writer, *buffer, capacity, 10);
+    json_write_raw(&writer, "{\"type\":\"socklet:message\",\"seq\":", 32);
+    json_write_int64(&writer, sequence);
+    json_write_raw(&writer, ",\"data\":", 8);
+    json_write_string(&writer, message, message_length);
+    json_write_raw(&writer, "}", 1);
+
+    return encode_json_frame(&writer, 0x1, frame_length);
+}
+
+static unsigned int session_bucket(const char *token)
+{
+    uint32_t hash = 2166136261u;
+    for (const char *c = token; *c; c++)
+    {
+        hash = (hash ^ (unsigned char)*c) * 16777619u;
+    }
+    return hash % SOCKLET_SESSION_BUCKETS;
+}
+
+static void session_release(session_t *session)
+{
+    if (atomic_fetch_sub(&session->references, 1) == 1)
+    {
+        replay_free(&session->replay);
+        pthread_mutex_destroy(&session->lock);
+        free(session);
+    }
+}
+
+static void session_unlink_detached_locked(session_t *session)
+{
+    if (session->detached_prev)
+        session->detached_prev->detached_next = session->detached_next;
+    else
+        detached_sessions_head = session->detached_next;
+
+    if (session->detached_next)
+        session->detached_next->detached_prev = session->detached_prev;
+    else
+        detached_sessions_tail = session->detached_prev;
+
+    session->detached_prev = NULL;
+    session->detached_next = NULL;
+}
+
+static void session_unlink_locked(session_t *session)
+{
+    session_t **link = &sessions[session_bucket(session->token)];
+    while (*link && *link != session)
+    {
+        link = &(*link)->next;
+    }
+    if (*link)
+    {
+        *link = session->next;
+    }
+
+    if (session->client == NULL)
+    {
+        session_unlink_detached_locked(session);
+    }
+
+    session_count--;
+    session_release(session);
+}
+
+// Detached sessions are kept in detach order, so the oldest is always the
+// next to expire or to be evicted when the table is full.
+static void session_prune_locked(time_t now)
+{
+    while (detached_sessions_head &&
+           (session_count >= SOCKLET_MAX_SESSIONS || now - detached_sessions_head->detached_at > SOCKLET_SESSION_TTL))
+    {
+        session_unlink_locked(detached_sessions_head);
+    }
+}
+
+static session_t *session_find_locked(const char *token)
+{
+    for (session_t *session = sessions[session_bucket(token)]; session; session = session->next)
+    {
+        if (strcmp(session->token, token) == 0)
+            return session;
+    }
+    return NULL;
+}
+
+static session_t *session_register(client_t *client, const char *token, uint64_t next_sequence)
+{
+    static const char hex[] = "0123456789abcdef";
+    unsigned char random[(SOCKLET_SESSION_TOKEN_SIZE - 1) / 2];
+
+    session_t *session = calloc(1, sizeof(session_t));
+    if (!session)
+    {
+        perror("Failed to allocate memory for session");
+        return NULL;
+    }
+
+    if (token)
+    {
+        snprintf(session->token, sizeof(session->token), "%s", token);
+    }
+    else if (RAND_bytes(random, sizeof(random)) != 1)
+    {
+        fprintf(stderr, "Failed to generate session token\n");
+        free(session);
+        return NULL;
+    }
+    else
+    {
+        for (size_t i = 0; i < sizeof(random); i++)
+        {
+            session->token[2 * i] = hex[random[i] >> 4];
+            session->token[2 * i + 1] = hex[random[i] & 0x0F];
+        }
+    }
+
+    session->client = client;
+    atomic_init(&session->references, 2);
+    pthread_mutex_init(&session->lock, NULL);
+    replay_init(&session->replay);
+    session->replay.next_sequence = next_sequence;
+
+    pthread_mutex_lock(&session_lock);
+    session_prune_locked(time(NULL));
+    unsigned int bucket = session_bucket(session->token);
+    session->next = sessions[bucket];
+    sessions[bucket] = session;
+    session_count++;
+    pthread_mutex_unlock(&session_lock);
+
+    client->session = session;
+    return session;
+}
+
+// Re-creates a session carried over from another process. Its replay history
+// stays behind, so a later resume from before the handoff gets a resync.
+session_t *session_adopt(client_t *client, const char *token, uint64_t next_sequence)
+{
+    return session_register(client, token, next_sequence);
+}
+
+session_t *session_create(client_t *client)
+{
+    session_t *session = session_register(client, NULL, 1);
+    if (!session)
+        return NULL;
+
+    char announcement[128];
+    snprintf(announcement, sizeof(announcement), "{\"type\":\"socklet:session\",\"session\":\"%s\",\"seq\":0}", session->token);
+    send_frame(client->client_fd, announcement);
+
+    return session;
+}
+
+int session_send(client_t *client, const char *message)
+{
+    session_t *session = client->session;
+    if (!session)
+    {
+        send_frame(client->client_fd, message);
+        return 0;
+    }
+
+    pthread_mutex_lock(&session->lock);
+
+    if (session->client != client)
+    {
+        pthread_mutex_unlock(&session->lock);
+        return -1;
+    }
+
+    void *buffer;
+    size_t frame_length;
+    unsigned char *frame = session_build_frame(session->replay.next_sequence, message, &buffer, &frame_length);
+    if (!frame)
+    {
+        free(buffer);
+        pthread_mutex_unlock(&session->lock);
+        return -1;
+    }
+
+    int result = client_send(client, frame, frame_length);
+    replay_push(&session->replay, buffer, frame, frame_length);
+
+    pthread_mutex_unlock(&session->lock);
+    return result;
+}
+
+static void session_send_resync(client_t *client)
+{
+    char message[128];
+    snprintf(message, sizeof(message), "{\"type\":\"socklet:resync\",\"session\":\"%s\"}",
+             client->session ? client->session->token : "");
+    send_frame(client->client_fd, message);
+}
+
+int session_resume(client_t *client, const char *token, uint64_t last_sequence)
+{
+    session_t *current = client->session;
+
+    pthread_mutex_lock(&session_lock);
+    session_prune_locked(time(NULL));
+
+    session_t *session = session_find_locked(token);
+    if (!session || session == current)
+    {
+        pthread_mutex_unlock(&session_lock);
+        session_send_resync(client);
+        return -1;
+    }
+
+    pthread_mutex_lock(&session->lock);
+
+    replay_ring_t *ring = &session->replay;
+    if (last_sequence >= ring->next_sequence || last_sequence + 1 < ring->next_sequence - ring->count)
+    {
+        pthread_mutex_unlock(&session->lock);
+        pthread_mutex_unlock(&session_lock);
+        session_send_resync(client);
+        return -1;
+    }
+
+    // A client that reconnects before the server noticed the old connection
+    // drop takes the session over; sends on the stale connection are refused.
+    if (session->client == NULL)
+    {
+        session_unlink_detached_locked(session);
+    }
+    session->client = client;
+    atomic_fetch_add(&session->references, 1);
+    client->session = session;
+
+    if (current)
+    {
+        session_unlink_locked(current);
+    }
+
+    pthread_mutex_unlock(&session_lock);
+
+    char acknowledgement[128];
+    snprintf(acknowledgement, sizeof(acknowledgement), "{\"type\":\"socklet:resumed\",\"session\":\"%s\",\"seq\":%llu}",
+             session->token, (unsigned long long)(ring->next_sequence - 1));
+    send_frame(client->client_fd, acknowledgement);
+
+    for (uint64_t sequence = last_sequence + 1; sequence < ring->next_sequence; sequence++)
+    {
+        replay_entry_t *entry = &ring->entries[sequence % SOCKLET_REPLAY_CAPACITY];
+        client_send(client, entry->frame, entry->length);
+    }
+
+    pthread_mutex_unlock(&session->lock);
+
+    if (current)
+    {
+        session_release(current);
+    }
+
+    return 0;
+}
+
+void session_detach(client_t *client)
+{
+    session_t *session = client->session;
+    if (!session)
+        return;
+
+    client->session = NULL;
+
+    pthread_mutex_lock(&session_lock);
+    pthread_mutex_lock(&session->lock);
+
+    if (session->client == client)
+    {
+        session->client = NULL;
+        session->detached_at = time(NULL);
+        session->detached_prev = detached_sessions_tail;
+        session->detached_next = NULL;
+        if (detached_sessions_tail)
+            detached_sessions_tail->detached_next = session;
+        else
+            detached_sessions_head = session;
+        detached_sessions_tail = session;
+    }
+
+    pthread_mutex_unlock(&session->lock);
+    pthread_mutex_unlock(&session_lock);
+
+    session_release(session);
+}
+
+// Ends a handler routed with client_stream() whose message has not started,
+// so it can release its context.
+static void client_stream_cancel(client_t *client)
+{
+    const stream_handler_t *handler = client->stream_handler;
+
+    if (client->reader.streaming || !handler || handler == client->server->stream_handler)
+        return;
+
+    if (handler->on_end)
+        handler->on_end(client, false);
+
+    client->stream_handler = client->server->stream_handler;
+    client->stream_context = NULL;
+}
+
+void client_stream(client_t *client, const stream_handler_t *handler, void *context)
+{
+    client_stream_cancel(client);
+    client->stream_handler = handler;
+    client->stream_context = context;
+}
+
+static bool stream_fd_chunk(client_t *client, const unsigned char *chunk, size_t length)
+{
+    int fd = (int)(intptr_t)client->stream_context;
+
+    while (length > 0)
+    {
+        ssize_t written = write(fd, chunk, length);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("Failed to write stream chunk");
+            return false;
+        }
+        chunk += written;
+        length -= written;
+    }
+
+    return true;
+}
+
+static void stream_fd_end(client_t *client, bool complete)
+{
+    (void)complete;
+    close((int)(intptr_t)client->stream_context);
+}
+
+const stream_handler_t stream_fd_handler = {NULL, stream_fd_chunk, stream_fd_end};
+
+void send_close_frame(int client_fd, uint16_t code)
+{
+    unsigned char frame[4] = {0x88, 2, code >> 8, code & 0xFF};
+    send_raw_frame(client_fd, frame, sizeof(frame));
+}
+
+void frame_reader_init(frame_reader_t *reader, size_t message_limit)
+{
+    memset(reader, 0, sizeof(*reader));
+    reader->header_needed = 2;
+    reader->message_limit = message_limit;
+}
+
+static int frame_reader_fail(client_t *client, uint16_t code, const char *reason)
+{
+    fprintf(stderr, "Closing client %d: %s\n", client->client_fd, reason);
+    send_close_frame(client->client_fd, code);
+    return -1;
+}
+
+// A handler routed with client_stream() receives a single message; the
+// connection then falls back to the server-wide handler.
+static void frame_reader_end_stream(client_t *client, bool complete)
+{
+    const stream_handler_t *handler = client->stream_handler;
+
+    client->reader.streaming = false;
+    if (handler->on_end)
+        handler->on_end(client, complete);
+
+    client->stream_handler = client->server->stream_handler;
+    client->stream_context = NULL;
+}
+
+static int frame_reader_begin(client_t *client)
+{
+    frame_reader_t *reader = &client->reader;
+    const unsigned char *header = reader->header;
+
+    reader->fin = header[0] & 0x80;
+    reader->opcode = header[0] & 0x0F;
+
+    if (header[0] & 0x70)
+        return frame_reader_fail(client, SOCKLET_CLOSE_PROTOCOL_ERROR, "reserved bits set");
+
+    if (!(header[1] & 0x80))
+        return frame_reader_fail(client, SOCKLET_CLOSE_PROTOCOL_ERROR, "MASK must be set");
+
+    uint64_t payload_length = header[1] & 0x7F;
+    size_t pos = 2;
+    if (payload_length == 126)
+    {
+        payload_length = (header[2] << 8) | header[3];
+        pos = 4;
+    }
+    else if (payload_length == 127)
+    {
+        payload_length = 0;
+        for (int i = 0; i < 8; i++)
+        {
+            payload_length = (payload_length << 8) | header[2 + i];
+        }
+        pos = 10;
+    }
+    memcpy(reader->mask, header + pos, 4);
+    reader->payload_length = payload_length;
+    reader->payload_received = 0;
+
+    if (reader->opcode & 0x8)
+    {
+        if (!reader->fin || payload_length > sizeof(reader->control))
+            return frame_reader_fail(client, SOCKLET_CLOSE_PROTOCOL_ERROR, "invalid control frame");
+        return 0;
+    }
+
+    if (reader->opcode == 0x0)
+    {
+        if (!reader->message_opcode)
+            return frame_reader_fail(client, SOCKLET_CLOSE_PROTOCOL_ERROR, "unexpected continuation frame");
+    }
+    else if (reader->opcode == 0x1 || reader->opcode == 0x2)
+    {
+        if (reader->message_opcode)
+            return frame_reader_fail(client, SOCKLET_CLOSE_PROTOCOL_ERROR, "interleaved data frames");
+
+        reader->message_opcode = reader->opcode;
+        reader->message_length = 0;
+        utf8_validator_init(&reader->utf8);
+        reader->streaming = reader->opcode == 0x2 && client->stream_handler;
+
+        if (reader->streaming && client->stream_handler->on_start && !client->stream_handler->on_start(client))
+        {
+            frame_reader_end_stream(client, false);
+            return frame_reader_fail(client, SOCKLET_CLOSE_POLICY_VIOLATION, "stream rejected");
+        }
+    }
+    else
+    {
+        return frame_reader_fail(client, SOCKLET_CLOSE_PROTOCOL_ERROR, "invalid opcode");
+    }
+
+    if (!reader->streaming)
+    {
+        if (payload_length >= reader->message_limit - reader->message_length)
+            return frame_reader_fail(client, SOCKLET_CLOSE_MESSAGE_TOO_BIG, "message exceeds connection memory");
+
+        size_t needed = reader->message_length + payload_length + 1;
+        if (needed > reader->message_capacity)
+        {
+            unsigned char *message;
+            size_t capacity;
+
+            // Small messages borrow a block from the loop's pool; anything
+            // larger moves to its own allocation.
+            if (!reader->message && needed <= SOCKLET_POOL_BLOCK_SIZE)
+            {
+                message = pool_lease(reader->pool);
+                capacity = SOCKLET_POOL_BLOCK_SIZE;
+                reader->pooled = true;
+            }
+            else
+            {
+                capacity = reader->message_capacity ? reader->message_capacity : BUFFER_SIZE;
+                while (capacity < needed)
+                {
+                    capacity *= 2;
+                }
+                if (capacity > reader->message_limit)
+                    capacity = reader->message_limit;
+
+                if (reader->pooled)
+                {
+                    message = malloc(capacity);
+                    if (message)
+                    {
+                        memcpy(message, reader->message, reader->message_length);
+                        pool_return(reader->pool, reader->message);
+                        reader->pooled = false;
+                    }
+                }
+                else
+                {
+                    message = realloc(reader->message, capacity);
+                }
+            }
+
+            if (!message)
+                return frame_reader_fail(client, SOCKLET_CLOSE_MESSAGE_TOO_BIG, "failed to grow message buffer");
+            reader->message = message;
+            reader->message_capacity = capacity;
+        }
+    }
+
+    return 0;
+}
+
+static void frame_reader_release_message(frame_reader_t *reader)
+{
+    if (reader->pooled)
+        pool_return(reader->pool, reader->message);
+    else
+        free(reader->message);
+    reader->message = NULL;
+    reader->message_capacity = 0;
+    reader->pooled = false;
+}
+
+// Hands a complete message to the rate limiter and then dispatches it. The
+// server-wide bucket is charged before parsing; per-event buckets are charged
+// on the event the parser resolved, so the limiter and dispatch always agree
+// on which event a message is. A delayed message stays in the reader until
+// the loop retries it.
+static int frame_reader_deliver(client_t *client)
+{
+    frame_reader_t *reader = &client->reader;
+    dispatch_envelope_t envelope;
+    char *error = NULL;
+    bool parsed = false;
+
+    int verdict = rate_limit_check(client, reader->message_length);
+    if (verdict == 0)
+    {
+        parsed = dispatch_envelope_parse((const char *)reader->message, &envelope, &error);
+        if (parsed)
+            verdict = rate_limit_check_event(client, &envelope, reader->message_length);
+        else
+            printf("Failed to parse JSON: %s\n", error);
+    }
+
+    if (verdict == 2)
+    {
+        client->held = true;
+        return 2;
+    }
+
+    client->held = false;
+    if (verdict < 0)
+        return frame_reader_fail(client, SOCKLET_CLOSE_POLICY_VIOLATION, "rate limit exceeded");
+    if (verdict == 0 && parsed)
+        handle_envelope(client, &envelope);
+
+    frame_reader_release_message(reader);
+    return 0;
+}
+
+// Keeps the unread tail of a receive buffer while a message is held, since
+// the buffer belongs to the loop and is reused for the next connection.
+static int frame_reader_hold(client_t *client, const unsigned char *data, size_t length)
+{
+    if (length > 0)
+    {
+        client->pending = malloc(length);
+        if (!client->pending)
+            return frame_reader_fail(client, SOCKLET_CLOSE_POLICY_VIOLATION, "failed to hold pending bytes");
+        memcpy(client->pending, data, length);
+        client->pending_length = length;
+    }
+    return 2;
+}
+
+static int frame_reader_complete(client_t *client)
+{
+    frame_reader_t *reader = &client->reader;
+
+    reader->header_length = 0;
+    reader->header_needed = 2;
+
+    switch (reader->opcode)
+    {
+    case 0x8:
+        printf("Received close frame.\n");
+        send_close_frame(client->client_fd, SOCKLET_CLOSE_NORMAL);
+        return 1;
+    case 0x9:
+    {
+        unsigned char pong[2 + sizeof(reader->control)];
+        size_t length = reader->payload_length < sizeof(reader->control) ? reader->payload_length : sizeof(reader->control);
+        size_t header_length = encode_frame_header(pong, 0xA, length);
+        memcpy(pong + header_length, reader->control, length);
+        client_send(client, pong, header_length + length);
+        return 0;
+    }
+    case 0xA:
+        return 0;
+    }
+
+    if (!reader->fin)
+        return 0;
+
+    // Streamed messages are never held whole, so they are not recorded.
+    if (reader->streaming)
+    {
+        reader->message_opcode = 0;
+        frame_reader_end_stream(client, true);
+        return 0;
+    }
+
+    if (reader->message_opcode == 0x1 && !utf8_finish(&reader->utf8))
+        return frame_reader_fail(client, SOCKLET_CLOSE_INVALID_PAYLOAD, "invalid UTF-8 in text message");
+
+    if (client->server->recorder)
+        trace_record(client->server->recorder, client->id, reader->message_opcode, reader->message, reader->message_length);
+
+    reader->message_opcode = 0;
+    reader->message[reader->message_length] = '\0';
+    return frame_reader_deliver(client);
+}
+
+int frame_reader_feed(client_t *client, unsigned char *data, size_t length)
+{
+    frame_reader_t *reader = &client->reader;
+
+    while (length > 0)
+    {
+        if (reader->header_length < reader->header_needed)
+        {
+            size_t take = reader->header_needed - reader->header_length;
+            if (take > length)
+                take = length;
+            memcpy(reader->header + reader->header_length, data, take);
+            reader->header_length += take;
+            data += take;
+            length -= take;
+
+            if (reader->header_length == 2)
+            {
+                unsigned char short_length = reader->header[1] & 0x7F;
+                reader->header_needed = 2 + (short_length == 126 ? 2 : short_length == 127 ? 8 : 0) + 4;
+            }
+
+            if (reader->header_length < reader->header_needed)
+                continue;
+
+            int result = frame_reader_begin(client);
+            if (result != 0)
+                return result;
+
+            if (reader->payload_length == 0)
+            {
+                result = frame_reader_complete(client);
+                if (result == 2)
+                    return frame_reader_hold(client, data, length);
+                if (result != 0)
+                    return result;
+            }
+            continue;
+        }
+
+        uint64_t remaining = reader->payload_length - reader->payload_received;
+        size_t take = remaining < length ? remaining : length;
+
+        if (reader->opcode & 0x8)
+        {
+            unmask_payload(data, take, reader->mask, reader->payload_received);
+            memcpy(reader->control + reader->payload_received, data, take);
+        }
+        else
+        {
+            if (reader->message_opcode == 0x1)
+            {
+                if (!utf8_unmask_validate(&reader->utf8, data, take, reader->mask, reader->payload_received))
+                    return frame_reader_fail(client, SOCKLET_CLOSE_INVALID_PAYLOAD, "invalid UTF-8 in text message");
+            }
+            else
+            {
+                unmask_payload(data, take, reader->mask, reader->payload_received);
+            }
+
+            if (reader->streaming)
+            {
+                if (!client->stream_handler->on_chunk(client, data, take))
+                    return frame_reader_fail(client, SOCKLET_CLOSE_POLICY_VIOLATION, "stream aborted by handler");
+            }
+            else
+            {
+                memcpy(reader->message + reader->message_length, data, take);
+                reader->message_length += take;
+            }
+        }
+
+        reader->payload_received += take;
+        data += take;
+        length -= take;
+
+        if (reader->payload_received == reader->payload_length)
+        {
+            int result = frame_reader_complete(client);
+            if (result == 2)
+                return frame_reader_hold(client, data, length);
+            if (result != 0)
+                return result;
+        }
+    }
+
+    return 0;
+}
+
+void frame_reader_release(client_t *client)
+{
+    frame_reader_t *reader = &client->reader;
+
+    if (reader->streaming)
+    {
+        frame_reader_end_stream(client, false);
+    }
+    else
+    {
+        client_stream_cancel(client);
+    }
+
+    frame_reader_release_message(reader);
+    free(client->pending);
+    client->pending = NULL;
+    client->pending_length = 0;
+}
+
+// UTF-8 validation uses the lookup-table method of Keiser and Lemire: three
+// nibble lookups classify every byte pair, and the bits that survive the AND
+// are errors. Blocks are validated as they are unmasked, so text payloads are
+// only read once. Partial blocks are carried between chunks.
+
+#define UTF8_TOO_SHORT 0x01
+#define UTF8_TOO_LONG 0x02
+#define UTF8_OVERLONG_3 0x04
+#define UTF8_TOO_LARGE 0x08
+#define UTF8_SURROGATE 0x10
+#define UTF8_OVERLONG_2 0x20
+#define UTF8_TOO_LARGE_1000 0x40
+#define UTF8_OVERLONG_4 0x40
+#define UTF8_TWO_CONTS 0x80
+#define UTF8_CARRY (UTF8_TOO_SHORT | UTF8_TOO_LONG | UTF8_TWO_CONTS)
+
+static const unsigned char utf8_byte_1_high[16] = {
+    UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG,
+    UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG,
+    UTF8_TWO_CONTS, UTF8_TWO_CONTS, UTF8_TWO_CONTS, UTF8_TWO_CONTS,
+    UTF8_TOO_SHORT | UTF8_OVERLONG_2,
+    UTF8_TOO_SHORT,
+    UTF8_TOO_SHORT | UTF8_OVERLONG_3 | UTF8_SURROGATE,
+    UTF8_TOO_SHORT | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4};
+
+static const unsigned char utf8_byte_1_low[16] = {
+    UTF8_CARRY | UTF8_OVERLONG_3 | UTF8_OVERLONG_2 | UTF8_OVERLONG_4,
+    UTF8_CARRY | UTF8_OVERLONG_2,
+    UTF8_CARRY,
+    UTF8_CARRY,
+    UTF8_CARRY | UTF8_TOO_LARGE,
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | UTF8_SURROGATE,
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000};
+
+static const unsigned char utf8_byte_2_high[16] = {
+    UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+    UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+    UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_OVERLONG_3 | UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4,
+    UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_OVERLONG_3 | UTF8_TOO_LARGE,
+    UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_SURROGATE | UTF8_TOO_LARGE,
+    UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_SURROGATE | UTF8_TOO_LARGE,
+    UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT};
+
+// Any byte above these limits in the last positions of a block starts a
+// sequence that continues into the next block.
+static const unsigned char utf8_incomplete_limits[32] = {
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xEF, 0xDF, 0xBF};
+
+typedef void (*utf8_kernel_t)(utf8_validator_t *validator, unsigned char *data, size_t blocks, const unsigned char *key);
+
+static int utf8_selected = -1;
+
+static void utf8_validate_scalar(utf8_validator_t *validator, const unsigned char *data, size_t length)
+{
+    size_t i = 0;
+
+    while (i < length)
+    {
+        if (validator->remaining == 0)
+        {
+            while (i + 8 <= length)
+            {
+                uint64_t word;
+                memcpy(&word, data + i, sizeof(word));
+                if (word & 0x8080808080808080ULL)
+                    break;
+                i += 8;
+            }
+            if (i == length)
+                break;
+
+            unsigned char byte = data[i++];
+            if (byte < 0x80)
+                continue;
+
+            validator->lower = 0x80;
+            validator->upper = 0xBF;
+            if (byte >= 0xC2 && byte <= 0xDF)
+                validator->remaining = 1;
+            else if (byte >= 0xE0 && byte <= 0xEF)
+            {
+                validator->remaining = 2;
+                if (byte == 0xE0)
+                    validator->lower = 0xA0;
+                else if (byte == 0xED)
+                    validator->upper = 0x9F;
+            }
+            else if (byte >= 0xF0 && byte <= 0xF4)
+            {
+                validator->remaining = 3;
+                if (byte == 0xF0)
+                    validator->lower = 0x90;
+                else if (byte == 0xF4)
+                    validator->upper = 0x8F;
+            }
+            else
+            {
+                validator->error = 1;
+                return;
+            }
+        }
+        else
+        {
+            unsigned char byte = data[i++];
+            if (byte < validator->lower || byte > validator->upper)
+            {
+                validator->error = 1;
+                return;
+            }
+            validator->remaining--;
+            validator->lower = 0x80;
+            validator->upper = 0xBF;
+        }
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+__attribute__((target("ssse3"))) static void utf8_kernel_ssse3(utf8_validator_t *validator, unsigned char *data, size_t blocks, const unsigned char *key)
+{
+    const __m128i low_nibble = _mm_set1_epi8(0x0F);
+    const __m128i byte_1_high = _mm_loadu_si128((const __m128i *)utf8_byte_1_high);
+    const __m128i byte_1_low = _mm_loadu_si128((const __m128i *)utf8_byte_1_low);
+    const __m128i byte_2_high = _mm_loadu_si128((const __m128i *)utf8_byte_2_high);
+    const __m128i limits = _mm_loadu_si128((const __m128i *)(utf8_incomplete_limits + 16));
+    const __m128i third_byte = _mm_set1_epi8((char)(0xE0 - 0x80));
+    const __m128i fourth_byte = _mm_set1_epi8((char)(0xF0 - 0x80));
+    const __m128i high_bit = _mm_set1_epi8((char)0x80);
+    const __m128i mask = key ? _mm_loadu_si128((const __m128i *)key) : _mm_setzero_si128();
+
+    __m128i previous = _mm_loadu_si128((const __m128i *)validator->previous);
+    __m128i incomplete = _mm_loadu_si128((const __m128i *)validator->incomplete);
+    __m128i error = _mm_setzero_si128();
+
+    for (size_t block = 0; block < blocks; block++, data += 16)
+    {
+        __m128i input = _mm_loadu_si128((const __m128i *)data);
+        if (key)
+        {
+            input = _mm_xor_si128(input, mask);
+            _mm_storeu_si128((__m128i *)data, input);
+        }
+
+        if (_mm_movemask_epi8(input) == 0)
+        {
+            error = _mm_or_si128(error, incomplete);
+            incomplete = _mm_setzero_si128();
+        }
+        else
+        {
+            __m128i prev1 = _mm_alignr_epi8(input, previous, 15);
+            __m128i special = _mm_and_si128(
+                _mm_and_si128(_mm_shuffle_epi8(byte_1_high, _mm_and_si128(_mm_srli_epi16(prev1, 4), low_nibble)),
+                              _mm_shuffle_epi8(byte_1_low, _mm_and_si128(prev1, low_nibble))),
+                _mm_shuffle_epi8(byte_2_high, _mm_and_si128(_mm_srli_epi16(input, 4), low_nibble)));
+
+            __m128i prev2 = _mm_alignr_epi8(input, previous, 14);
+            __m128i prev3 = _mm_alignr_epi8(input, previous, 13);
+            __m128i must_continue = _mm_and_si128(
+                _mm_or_si128(_mm_subs_epu8(prev2, third_byte), _mm_subs_epu8(prev3, fourth_byte)), high_bit);
+
+            error = _mm_or_si128(error, _mm_xor_si128(must_continue, special));
+            incomplete = _mm_subs_epu8(input, limits);
+        }
+        previous = input;
+    }
+
+    _mm_storeu_si128((__m128i *)validator->previous, previous);
+    _mm_storeu_si128((__m128i *)validator->incomplete, incomplete);
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(error, _mm_setzero_si128())) != 0xFFFF)
+        validator->error = 1;
+}
+
+__attribute__((target("avx2"))) static void utf8_kernel_avx2(utf8_validator_t *validator, unsigned char *data, size_t blocks, const unsigned char *key)
+{
+    const __m256i low_nibble = _mm256_set1_epi8(0x0F);
+    const __m256i byte_1_high = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)utf8_byte_1_high));
+    const __m256i byte_1_low = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)utf8_byte_1_low));
+    const __m256i byte_2_high = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)utf8_byte_2_high));
+    const __m256i limits = _mm256_loadu_si256((const __m256i *)utf8_incomplete_limits);
+    const __m256i third_byte = _mm256_set1_epi8((char)(0xE0 - 0x80));
+    const __m256i fourth_byte = _mm256_set1_epi8((char)(0xF0 - 0x80));
+    const __m256i high_bit = _mm256_set1_epi8((char)0x80);
+    const __m256i mask = key ? _mm256_loadu_si256((const __m256i *)key) : _mm256_setzero_si256();
+
+    __m256i previous = _mm256_loadu_si256((const __m256i *)validator->previous);
+    __m256i incomplete = _mm256_loadu_si256((const __m256i *)validator->incomplete);
+    __m256i error = _mm256_setzero_si256();
+
+    for (size_t block = 0; block < blocks; block++, data += 32)
+    {
+        __m256i input = _mm256_loadu_si256((const __m256i *)data);
+        if (key)
+        {
+            input = _mm256_xor_si256(input, mask);
+            _mm256_storeu_si256((__m256i *)data, input);
+        }
+
+        if (_mm256_movemask_epi8(input) == 0)
+        {
+            error = _mm256_or_si256(error, incomplete);
+            incomplete = _mm256_setzero_si256();
+        }
+        else
+        {
+            __m256i shifted = _mm256_permute2x128_si256(previous, input, 0x21);
+            __m256i prev1 = _mm256_alignr_epi8(input, shifted, 15);
+            __m256i special = _mm256_and_si256(
+                _mm256_and_si256(_mm256_shuffle_epi8(byte_1_high, _mm256_and_si256(_mm256_srli_epi16(prev1, 4), low_nibble)),
+                                 _mm256_shuffle_epi8(byte_1_low, _mm256_and_si256(prev1, low_nibble))),
+                _mm256_shuffle_epi8(byte_2_high, _mm256_and_si256(_mm256_srli_epi16(input, 4), low_nibble)));
+
+            __m256i prev2 = _mm256_alignr_epi8(input, shifted, 14);
+            __m256i prev3 = _mm256_alignr_epi8(input, shifted, 13);
+            __m256i must_continue = _mm256_and_si256(
+                _mm256_or_si256(_mm256_subs_epu8(prev2, third_byte), _mm256_subs_epu8(prev3, fourth_byte)), high_bit);
+
+            error = _mm256_or_si256(error, _mm256_xor_si256(must_continue, special));
+            incomplete = _mm256_subs_epu8(input, limits);
+        }
+        previous = input;
+    }
+
+    _mm256_storeu_si256((__m256i *)validator->previous, previous);
+    _mm256_storeu_si256((__m256i *)validator->incomplete, incomplete);
+    if (!_mm256_testz_si256(error, error))
+        validator->error = 1;
+}
+
+#endif
+
+int utf8_set_implementation(int implementation)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (implementation < 0)
+    {
+        implementation = __builtin_cpu_supports("avx2") ? SOCKLET_UTF8_AVX2
+                         : __builtin_cpu_supports("ssse3") ? SOCKLET_UTF8_SSSE3
+                                                            : SOCKLET_UTF8_SCALAR;
+    }
+    if ((implementation == SOCKLET_UTF8_AVX2 && !__builtin_cpu_supports("avx2")) ||
+        (implementation == SOCKLET_UTF8_SSSE3 && !__builtin_cpu_supports("ssse3")))
+        return -1;
+#else
+    if (implementation < 0)
+        implementation = SOCKLET_UTF8_SCALAR;
+    if (implementation != SOCKLET_UTF8_SCALAR)
+        return -1;
+#endif
+    utf8_selected = implementation;
+    return 0;
+}
+
+const char *utf8_implementation_name(void)
+{
+    if (utf8_selected < 0)
+        utf8_set_implementation(-1);
+
+    switch (utf8_selected)
+    {
+    case SOCKLET_UTF8_AVX2:
+        return "avx2";
+    case SOCKLET_UTF8_SSSE3:
+        return "ssse3";
+    default:
+        return "scalar";
+    }
+}
+
+static utf8_kernel_t utf8_kernel(size_t *block_size)
+{
+    if (utf8_selected < 0)
+        utf8_set_implementation(-1);
+
+#if defined(__x86_64__) || defined(__i386__)
+    if (utf8_selected == SOCKLET_UTF8_AVX2)
+    {
+        *block_size = 32;
+        return utf8_kernel_avx2;
+    }
+    if (utf8_selected == SOCKLET_UTF8_SSSE3)
+    {
+        *block_size = 16;
+        return utf8_kernel_ssse3;
+    }
+#endif
+    *block_size = 0;
+    return NULL;
+}
+
+void utf8_validator_init(utf8_validator_t *validator)
+{
+    memset(validator, 0, sizeof(*validator));
+}
+
+bool utf8_unmask_validate(utf8_validator_t *validator, unsigned char *data, size_t length, const unsigned char *mask, size_t offset)
+{
+    size_t block_size;
+    utf8_kernel_t kernel = utf8_kernel(&block_size);
+
+    if (!kernel)
+    {
+        if (mask)
+            unmask_payload(data, length, mask, offset);
+        utf8_validate_scalar(validator, data, length);
+        return !validator->error;
+    }
+
+    if (validator->carry_length > 0)
+    {
+        size_t take = block_size - validator->carry_length;
+        if (take > length)
+            take = length;
+        if (mask)
+            unmask_payload(data, take, mask, offset);
+        memcpy(validator->carry + validator->carry_length, data, take);
+        validator->carry_length += take;
+        data += take;
+        length -= take;
+        offset += take;
+
+        if (validator->carry_length < block_size)
+            return !validator->error;
+
+        kernel(validator, validator->carry, 1, NULL);
+        validator->carry_length = 0;
+    }
+
+    size_t blocks = length / block_size;
+    if (blocks > 0)
+    {
+        unsigned char key[32];
+        for (size_t i = 0; i < sizeof(key); i++)
+        {
+            key[i] = mask ? mask[(offset + i) % 4] : 0;
+        }
+        kernel(validator, data, blocks, mask ? key : NULL);
+        data += blocks * block_size;
+        length -= blocks * block_size;
+        offset += blocks * block_size;
+    }
+
+    if (length > 0)
+    {
+        if (mask)
+            unmask_payload(data, length, mask, offset);
+        memcpy(validator->carry, data, length);
+        validator->carry_length = length;
+    }
+
+    return !validator->error;
+}
+
+bool utf8_finish(utf8_validator_t *validator)
+{
+    size_t block_size;
+    utf8_kernel_t kernel = utf8_kernel(&block_size);
+    bool valid;
+
+    if (kernel)
+    {
+        // Zero padding makes a sequence cut off at the end of the message
+        // fail the same way as one followed by ASCII.
+        memset(validator->carry + validator->carry_length, 0, block_size - validator->carry_length);
+        kernel(validator, validator->carry, 1, NULL);
+        valid = !validator->error;
+    }
+    else
+    {
+        valid = !validator->error && validator->remaining == 0;
+    }
+
+    utf8_validator_init(validator);
+    return valid;
+}
+
+bool utf8_validate(const unsigned char *data, size_t length)
+{
+    utf8_validator_t validator;
+    utf8_validator_init(&validator);
+    utf8_unmask_validate(&validator, (unsigned char *)data, length, NULL, 0);
+    return utf8_finish(&validator);
+}
+
+
+uint64_t room_id(const char *name)
+{
+    uint64_t hash = 14695981039346656037ull;
+    for (const char *c = name; *c; c++)
+    {
+        hash = (hash ^ (unsigned char)*c) * 1099511628211ull;
+    }
+    return hash;
+}
+
+// Each client hashes its memberships by set address into an open-addressed
+// table twice the size of the membership array, holding index + 1 (0 is
+// empty), so joining, leaving and duplicate checks never scan the list.
+static size_t membership_probe(const client_t *client, const member_set_t *set)
+{
+    size_t mask = (size_t)client->membership_capacity * 2 - 1;
+    size_t probe = (size_t)(((uintptr_t)set >> 3) * 11400714819323198485ull >> 32) & mask;
+    while (client->membership_index[probe] && client->memberships[client->membership_index[probe] - 1].set != set)
+        probe = (probe + 1) & mask;
+    return probe;
+}
+
+static void membership_unindex(client_t *client, size_t probe)
+{
+    // Backward-shift deletion keeps every remaining entry reachable without tombstones.
+    size_t mask = (size_t)client->membership_capacity * 2 - 1;
+    size_t next = probe;
+    client->membership_index[probe] = 0;
+    while (client->membership_index[next = (next + 1) & mask])
+    {
+        uint32_t entry = client->membership_index[next];
+        client->membership_index[next] = 0;
+        client->membership_index[membership_probe(client, client->memberships[entry - 1].set)] = entry;
+    }
+}
+
+static int member_set_find(client_t *client, member_set_t *set)
+{
+    if (client->membership_count == 0)
+        return -1;
+    return (int)client->membership_index[membership_probe(client, set)] - 1;
+}
+
+static int member_set_add(member_set_t *set, client_t *client, bool topic)
+{
+    if (member_set_find(client, set) >= 0)
+        return 0;
+
+    if (set->count == set->capacity)
+    {
+        uint32_t capacity = set->capacity ? set->capacity * 2 : 4;
+        member_t *members = realloc(set->members, sizeof(member_t) * capacity);
+        if (!members)
+            return -1;
+        set->members = members;
+        set->capacity = capacity;
+    }
+
+    if (client->membership_count == client->membership_capacity)
+    {
+        uint32_t capacity = client->membership_capacity ? client->membership_capacity * 2 : 4;
+        membership_t *memberships = realloc(client->memberships, sizeof(membership_t) * capacity);
+        uint32_t *index = calloc((size_t)capacity * 2, sizeof(uint32_t));
+        if (memberships)
+            client->memberships = memberships;
+        if (!memberships || !index)
+        {
+            free(index);
+            return -1;
+        }
+        free(client->membership_index);
+        client->membership_index = index;
+        client->membership_capacity = capacity;
+        for (uint32_t i = 0; i < client->membership_count; i++)
+        {
+            client->membership_index[membership_probe(client, client->memberships[i].set)] = i + 1;
+        }
+    }
+
+    set->members[set->count] = (member_t){client->slot, client->membership_count};
+    client->membership_index[membership_probe(client, set)] = client->membership_count + 1;
+    client->memberships[client->membership_count++] = (membership_t){set, set->count++, topic};
+    return 1;
+}
+
+static void member_set_remove(client_t *client, uint32_t index)
+{
+    membership_t membership = client->memberships[index];
+    member_set_t *set = membership.set;
+
+    // Swap-remove on both sides, patching the back references of whatever moved.
+    set->members[membership.position] = set->members[--set->count];
+    if (membership.position < set->count)
+    {
+        member_t moved = set->members[membership.position];
+        client_slots[moved.slot]->memberships[moved.membership].position = membership.position;
+    }
+
+    membership_unindex(client, membership_probe(client, set));
+    client->memberships[index] = client->memberships[--client->membership_count];
+    if (index < client->membership_count)
+    {
+        membership_t moved = client->memberships[index];
+        moved.set->members[moved.position].membership = index;
+        client->membership_index[membership_probe(client, moved.set)] = index + 1;
+    }
+}
+
+static room_t *room_find_locked(uint64_t id, const char *name)
+{
+    for (room_t *room = rooms[id % SOCKLET_ROOM_BUCKETS]; room; room = room->next)
+    {
+        if (room->id == id && (!name || strcmp(room->name, name) == 0))
+            return room;
+    }
+    return NULL;
+}
+
+static void room_release_locked(room_t *room)
+{
+    if (room->members.count > 0)
+        return;
+
+    room_t **link = &rooms[room->id % SOCKLET_ROOM_BUCKETS];
+    while (*link != room)
+        link = &(*link)->next;
+    *link = room->next;
+
+    free(room->members.members);
+    free(room->name);
+    free(room);
+}
+
+int room_join(client_t *client, const char *name)
+{
+    uint64_t id = room_id(name);
+
+    pthread_rwlock_wrlock(&room_lock);
+    room_t *room = room_find_locked(id, name);
+    if (!room)
+    {
+        room = calloc(1, sizeof(room_t));
+        if (!room || !(room->name = strdup(name)))
+        {
+            perror("Failed to allocate room");
+            free(room);
+            pthread_rwlock_unlock(&room_lock);
+            return -1;
+        }
+        room->id = id;
+        room->next = rooms[id % SOCKLET_ROOM_BUCKETS];
+        rooms[id % SOCKLET_ROOM_BUCKETS] = room;
+    }
+
+    int result = member_set_add(&room->members, client, false);
+    if (result < 0)
+    {
+        perror("Failed to join room");
+        room_release_locked(room);
+    }
+    pthread_rwlock_unlock(&room_lock);
+    return result < 0 ? -1 : 0;
+}
+
+int room_leave(client_t *client, const char *name)
+{
+    pthread_rwlock_wrlock(&room_lock);
+    room_t *room = room_find_locked(room_id(name), name);
+    int index = room ? member_set_find(client, &room->members) : -1;
+    if (index >= 0)
+    {
+        member_set_remove(client, (uint32_t)index);
+        room_release_locked(room);
+    }
+    pthread_rwlock_unlock(&room_lock);
+    return index >= 0 ? 0 : -1;
+}
+
+static void send_member_set(const member_set_t *set, const unsigned char *frame, size_t frame_length)
+{
+    for (uint32_t i = 0; i < set->count; i++)
+    {
+        client_queue(client_slots[set->members[i].slot], frame, frame_length);
+    }
+}
+
+int room_publish_frame(uint64_t id, const unsigned char *frame, size_t frame_length)
+{
+    pthread_rwlock_rdlock(&room_lock);
+    room_t *room = room_find_locked(id, NULL);
+    int delivered = room ? (int)room->members.count : 0;
+    if (room)
+        send_member_set(&room->members, frame, frame_length);
+    pthread_rwlock_unlock(&room_lock);
+    return delivered;
+}
+
+static unsigned char *encode_text_frame(const char *message, size_t *frame_length)
+{
+    size_t message_length = strlen(message);
+    unsigned char *frame = malloc(message_length + 10);
+    if (!frame)
+    {
+        perror("Failed to allocate frame");
+        return NULL;
+    }
+
+    size_t header_length = encode_frame_header(frame, 0x1, message_length);
+    memcpy(frame + header_length, message, message_length);
+    *frame_length = header_length + message_length;
+    return frame;
+}
+
+int room_publish(const char *name, const char *message)
+{
+    size_t frame_length;
+    unsigned char *frame = encode_text_frame(message, &frame_length);
+    if (!frame)
+        return -1;
+
+    uint64_t id = room_id(name);
+    pthread_rwlock_rdlock(&room_lock);
+    room_t *room = room_find_locked(id, name);
+    int delivered = room ? (int)room->members.count : 0;
+    if (room)
+        send_member_set(&room->members, frame, frame_length);
+    pthread_rwlock_unlock(&room_lock);
+
+    free(frame);
+    return delivered;
+}
+
+static int topic_split(const char *topic, char *copy, size_t size, char **segments)
+{
+    if (strlen(topic) >= size)
+        return -1;
+    strcpy(copy, topic);
+
+    int depth = 0;
+    char *save = NULL;
+    for (char *segment = strtok_r(copy, "/", &save); segment; segment = strtok_r(NULL, "/", &save))
+    {
+        if (depth == SOCKLET_TOPIC_MAX_DEPTH)
+            return -1;
+        segments[depth++] = segment;
+    }
+    return depth;
+}
+
+static topic_node_t *topic_child(topic_node_t *node, const char *segment, bool create)
+{
+    for (topic_node_t *child = node->children; child; child = child->sibling)
+    {
+        if (strcmp(child->segment, segment) == 0)
+            return child;
+    }
+    if (!create)
+        return NULL;
+
+    topic_node_t *child = calloc(1, sizeof(topic_node_t));
+    if (!child || !(child->segment = strdup(segment)))
+    {
+        free(child);
+        return NULL;
+    }
+    child->parent = node;
+    child->sibling = node->children;
+    node->children = child;
+    return child;
+}
+
+static void topic_prune_locked(topic_node_t *node)
+{
+    while (node != &topic_root && node->members.count == 0 && !node->children)
+    {
+        topic_node_t *parent = node->parent;
+        topic_node_t **link = &parent->children;
+        while (*link != node)
+            link = &(*link)->sibling;
+        *link = node->sibling;
+
+        free(node->members.members);
+        free(node->segment);
+        free(node);
+        node = parent;
+    }
+}
+
+int topic_subscribe(client_t *client, const char *pattern)
+{
+    char copy[256];
+    char *segments[SOCKLET_TOPIC_MAX_DEPTH];
+    int depth = topic_split(pattern, copy, sizeof(copy), segments);
+    if (depth <= 0)
+        return -1;
+
+    for (int i = 0; i < depth - 1; i++)
+    {
+        if (strcmp(segments[i], "#") == 0)
+            return -1;
+    }
+
+    pthread_rwlock_wrlock(&room_lock);
+    topic_node_t *node = &topic_root;
+    for (int i = 0; i < depth && node; i++)
+    {
+        topic_node_t *child = topic_child(node, segments[i], true);
+        if (!child)
+            topic_prune_locked(node);
+        node = child;
+    }
+
+    int result = node ? member_set_add(&node->members, client, true) : -1;
+    if (result < 0)
+    {
+        perror("Failed to subscribe to topic");
+        if (node)
+            topic_prune_locked(node);
+    }
+    pthread_rwlock_unlock(&room_lock);
+    return result < 0 ? -1 : 0;
+}
+
+int topic_unsubscribe(client_t *client, const char *pattern)
+{
+    char copy[256];
+    char *segments[SOCKLET_TOPIC_MAX_DEPTH];
+    int depth = topic_split(pattern, copy, sizeof(copy), segments);
+    if (depth <= 0)
+        return -1;
+
+    pthread_rwlock_wrlock(&room_lock);
+    topic_node_t *node = &topic_root;
+    for (int i = 0; i < depth && node; i++)
+    {
+        node = topic_child(node, segments[i], false);
+    }
+
+    int index = node ? member_set_find(client, &node->members) : -1;
+    if (index >= 0)
+    {
+        member_set_remove(client, (uint32_t)index);
+        topic_prune_locked(node);
+    }
+    pthread_rwlock_unlock(&room_lock);
+    return index >= 0 ? 0 : -1;
+}
+
+typedef struct
+{
+    const member_set_t **sets;
+    size_t count;
+    size_t capacity;
+    size_t members;
+} topic_match_t;
+
+static int topic_match_add(topic_match_t *match, const member_set_t *set)
+{
+    if (set->count == 0)
+        return 0;
+
+    if (match->count == match->capacity)
+    {
+        size_t capacity = match->capacity * 2;
+        const member_set_t **sets = realloc(match->sets, sizeof(member_set_t *) * capacity);
+        if (!sets)
+            return -1;
+        match->sets = sets;
+        match->capacity = capacity;
+    }
+    match->sets[match->count++] = set;
+    match->members += set->count;
+    return 0;
+}
+
+static int topic_match(const topic_node_t *node, char **segments, int depth, topic_match_t *match)
+{
+    for (const topic_node_t *child = node->children; child; child = child->sibling)
+    {
+        int result = 0;
+        if (strcmp(child->segment, "#") == 0)
+        {
+            result = topic_match_add(match, &child->members);
+        }
+        else if (depth > 0 && (strcmp(child->segment, "*") == 0 || strcmp(child->segment, segments[0]) == 0))
+        {
+            if (depth == 1)
+                result = topic_match_add(match, &child->members);
+            else
+                result = topic_match(child, segments + 1, depth - 1, match);
+        }
+        if (result < 0)
+            return -1;
+    }
+    return 0;
+}
+
+int topic_publish(const char *topic, const char *message)
+{
+    char copy[256];
+    char *segments[SOCKLET_TOPIC_MAX_DEPTH];
+    int depth = topic_split(topic, copy, sizeof(copy), segments);
+    if (depth <= 0)
+        return -1;
+
+    size_t frame_length;
+    unsigned char *frame = encode_text_frame(message, &frame_length);
+    if (!frame)
+        return -1;
+
+    topic_match_t match = {malloc(sizeof(member_set_t *) * 8), 0, 8, 0};
+    if (!match.sets)
+    {
+        free(frame);
+        return -1;
+    }
+
+    pthread_rwlock_rdlock(&room_lock);
+    if (topic_match(&topic_root, segments, depth, &match) < 0)
+    {
+        perror("Failed to match topic");
+        pthread_rwlock_unlock(&room_lock);
+        free(match.sets);
+        free(frame);
+        return -1;
+    }
+
+    int delivered = 0;
+    if (match.count == 1)
+    {
+        send_member_set(match.sets[0], frame, frame_length);
+        delivered = (int)match.members;
+    }
+    else if (match.count > 1)
+    {
+        // Overlapping patterns can match the same client more than once; an
+        // open-addressed slot set keeps delivery to one frame per client.
+        size_t table_size = 16;
+        while (table_size < match.members * 2)
+            table_size *= 2;
+        uint32_t *seen = malloc(sizeof(uint32_t) * table_size);
+        if (seen)
+        {
+            memset(seen, 0xFF, sizeof(uint32_t) * table_size);
+            for (size_t s = 0; s < match.count; s++)
+            {
+                for (uint32_t i = 0; i < match.sets[s]->count; i++)
+                {
+                    uint32_t slot = match.sets[s]->members[i].slot;
+                    size_t probe = (slot * 2654435761u) & (table_size - 1);
+                    while (seen[probe] != UINT32_MAX && seen[probe] != slot)
+                        probe = (probe + 1) & (table_size - 1);
+                    if (seen[probe] == slot)
+                        continue;
+                    seen[probe] = slot;
+                    client_queue(client_slots[slot], frame, frame_length);
+                    delivered++;
+                }
+            }
+            free(seen);
+        }
+    }
+    pthread_rwlock_unlock(&room_lock);
+
+    free(match.sets);
+    free(frame);
+    return delivered;
+}
+
+void client_leave_all(client_t *client)
+{
+    pthread_rwlock_wrlock(&room_lock);
+    while (client->membership_count > 0)
+    {
+        membership_t membership = client->memberships[client->membership_count - 1];
+        member_set_remove(client, client->membership_count - 1);
+        if (membership.topic)
+            topic_prune_locked((topic_node_t *)membership.set);
+        else
+            room_release_locked((room_t *)membership.set);
+    }
+    pthread_rwlock_unlock(&room_lock);
+
+    free(client->memberships);
+    free(client->membership_index);
+    client->memberships = NULL;
+    client->membership_index = NULL;
+    client->membership_capacity = 0;
+}
+
+
+// Hot restart: the old process listens on a Unix socket at the handoff path.
+// A new process connects there and receives the listening socket, then one
+// record per connection carrying the descriptor (SCM_RIGHTS), the client id,
+// session token and sequence, extra_info and the rooms and topics it was in.
+// Connections are moved between messages only, so bytes still queued in the
+// kernel are read by the new process.
+
+static int handoff_address(const char *path, struct sockaddr_un *address)
+{
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address->sun_path))
+    {
+        fprintf(stderr, "Handoff path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(address->sun_path, path);
+    return 0;
+}
+
+static int handoff_send(int connection, handoff_record_t *record, const char *payload, size_t payload_length, int fd)
+{
+    union
+    {
+        struct cmsghdr header;
+        char buffer[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct iovec iov[2] = {{record, sizeof(*record)}, {(void *)payload, payload_length}};
+    struct msghdr message = {0};
+
+    record->magic = SOCKLET_HANDOFF_MAGIC;
+    message.msg_iov = iov;
+    message.msg_iovlen = payload_length ? 2 : 1;
+
+    if (fd >= 0)
+    {
+        memset(&control, 0, sizeof(control));
+        message.msg_control = control.buffer;
+        message.msg_controllen = sizeof(control.buffer);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+
+    return sendmsg(connection, &message, MSG_NOSIGNAL) < 0 ? -1 : 0;
+}
+
+static ssize_t handoff_recv(int connection, char *buffer, size_t size, int *fd)
+{
+    union
+    {
+        struct cmsghdr header;
+        char buffer[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct iovec iov = {buffer, size};
+    struct msghdr message = {0};
+
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control.buffer;
+    message.msg_controllen = sizeof(control.buffer);
+
+    *fd = -1;
+    ssize_t length = recvmsg(connection, &message, MSG_CMSG_CLOEXEC);
+    if (length < 0)
+        return -1;
+
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message); cmsg; cmsg = CMSG_NXTHDR(&message, cmsg))
+    {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+            memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+    return length;
+}
+
+static int handoff_listen(server_t *server)
+{
+    struct sockaddr_un address;
+    if (handoff_address(server->handoff_path, &address) != 0)
+        return -1;
+
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        perror("handoff socket");
+        return -1;
+    }
+
+    unlink(server->handoff_path);
+    if (bind(fd, (struct sockaddr *)&address, sizeof(address)) < 0 || listen(fd, 1) < 0)
+    {
+        perror("handoff bind");
+        close(fd);
+        return -1;
+    }
+
+    server->handoff_fd = fd;
+    return 0;
+}
+
+static size_t topic_pattern(const topic_node_t *node, char *output, size_t size)
+{
+    const char *segments[SOCKLET_TOPIC_MAX_DEPTH];
+    int depth = 0;
+    for (; node != &topic_root && depth < SOCKLET_TOPIC_MAX_DEPTH; node = node->parent)
+    {
+        segments[depth++] = node->segment;
+    }
+
+    size_t length = 0;
+    while (depth-- > 0)
+    {
+        int written = snprintf(output + length, size - length, "%s%s", segments[depth], depth ? "/" : "");
+        if (written < 0 || (size_t)written >= size - length)
+            return 0;
+        length += written;
+    }
+    return length;
+}
+
+static int handoff_client(client_t *client)
+{
+    char *payload = malloc(SOCKLET_HANDOFF_RECORD_SIZE);
+    if (!payload)
+        return -1;
+
+    handoff_record_t record = {0};
+    record.kind = SOCKLET_HANDOFF_CLIENT;
+    record.id = client->id;
+
+    size_t length = 0;
+    if (client->extra_info)
+    {
+        size_t extra_length = strlen(client->extra_info);
+        if (extra_length < SOCKLET_HANDOFF_RECORD_SIZE / 2)
+        {
+            memcpy(payload, client->extra_info, extra_length);
+            record.extra_length = extra_length;
+            length = extra_length;
+        }
+    }
+
+    pthread_rwlock_rdlock(&room_lock);
+    for (uint32_t i = 0; i < client->membership_count; i++)
+    {
+        membership_t *membership = &client->memberships[i];
+        size_t available = SOCKLET_HANDOFF_RECORD_SIZE - sizeof(record) - length;
+        if (available < 2)
+            break;
+
+        payload[length] = membership->topic ? 't' : 'r';
+        size_t written;
+        if (membership->topic)
+        {
+            written = topic_pattern((topic_node_t *)membership->set, payload + length + 1, available - 1);
+        }
+        else
+        {
+            const char *name = ((room_t *)membership->set)->name;
+            written = strlen(name);
+            if (written + 1 < available - 1)
+                memcpy(payload + length + 1, name, written + 1);
+            else
+                written = 0;
+        }
+
+        if (written > 0)
+            length += written + 2;
+    }
+    pthread_rwlock_unlock(&room_lock);
+    record.memberships_length = length - record.extra_length;
+
+    session_t *session = client->session;
+    if (session)
+    {
+        pthread_mutex_lock(&session->lock);
+        if (session->client == client)
+        {
+            memcpy(record.session, session->token, sizeof(record.session));
+            record.sequence = session->replay.next_sequence;
+        }
+    }
+
+    // Output still queued here would interleave with the next process's
+    // writes, so only a drained client is handed off, and closing its output
+    // keeps fan-out from writing while the descriptor leaves. Rooms and
+    // topics are only left once the transfer succeeded.
+    pthread_mutex_lock(&client->output_lock);
+    bool drained = client->output_length == 0 && !client->output_closed;
+    if (drained)
+        client->output_closed = true;
+    pthread_mutex_unlock(&client->output_lock);
+
+    pthread_mutex_lock(&handoff_lock);
+    int result = drained && handoff_connection >= 0 ? handoff_send(handoff_connection, &record, payload, length, client->client_fd) : -1;
+    pthread_mutex_unlock(&handoff_lock);
+
+    if (result != 0 && drained)
+    {
+        pthread_mutex_lock(&client->output_lock);
+        client->output_closed = false;
+        pthread_mutex_unlock(&client->output_lock);
+    }
+
+    if (session)
+    {
+        if (result == 0 && session->client == client)
+            session->client = NULL;
+        pthread_mutex_unlock(&session->lock);
+    }
+
+    // A pending stream handler may still send, so it is ended before the
+    // client is removed and outside client_lock.
+    if (result == 0)
+    {
+        frame_reader_release(client);
+        client_remove(client);
+    }
+
+    free(payload);
+    return result;
+}
+
+static int handoff_start(server_t *server)
+{
+    int connection = accept(server->handoff_fd, NULL, NULL);
+    if (connection < 0)
+    {
+        perror("handoff accept");
+        return -1;
+    }
+
+    handoff_record_t record = {0};
+    record.kind = SOCKLET_HANDOFF_LISTENER;
+    if (handoff_send(connection, &record, NULL, 0, server->server_fd) != 0)
+    {
+        perror("handoff listener");
+        close(connection);
+        return -1;
+    }
+
+    printf("Handing off %d connections\n", atomic_load(&active_connections));
+
+    int64_t deadline = monotonic_ms() + SOCKLET_HANDOFF_DRAIN_MS;
+    pthread_mutex_lock(&handoff_lock);
+    handoff_connection = connection;
+    pthread_mutex_unlock(&handoff_lock);
+    atomic_store(&handoff_deadline, deadline);
+    atomic_store(&handoff_draining, true);
+
+    uint64_t wake = 1;
+    for (size_t i = 0; i < server->loop_count; i++)
+    {
+        if (write(server->loops[i]->wake_fd, &wake, sizeof(wake)) != sizeof(wake))
+            perror("handoff wake");
+    }
+
+    while (atomic_load(&active_connections) > 0 && monotonic_ms() < deadline + 100)
+    {
+        usleep(10000);
+    }
+
+    pthread_mutex_lock(&handoff_lock);
+    record.kind = SOCKLET_HANDOFF_END;
+    handoff_send(connection, &record, NULL, 0, -1);
+    close(connection);
+    handoff_connection = -1;
+    pthread_mutex_unlock(&handoff_lock);
+
+    server->handed_off = true;
+    printf("Handoff complete, %d connections left behind\n", atomic_load(&active_connections));
+    return 0;
+}
+
+static int handoff_adopt(server_t *server, const handoff_record_t *record, const char *payload, size_t length, int fd)
+{
+    if ((size_t)record->extra_length + record->memberships_length > length)
+    {
+        close(fd);
+        return -1;
+    }
+
+    client_t *client = calloc(1, sizeof(client_t));
+    if (!client)
+    {
+        perror("Failed to allocate adopted client");
+        close(fd);
+        return -1;
+    }
+
+    socklen_t address_length = sizeof(client->client_address);
+    getpeername(fd, (struct sockaddr *)&client->client_address, &address_length);
+    client->id = record->id;
+    client->client_fd = fd;
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    client->state = SOCKLET_CLIENT_OPEN;
+    client->extra_info = record->extra_length ? strndup(payload, record->extra_length) : NULL;
+    client->server = server;
+    client->stream_handler = server->stream_handler;
+    frame_reader_init(&client->reader, server->connection_memory > SOCKLET_CHUNK_SIZE ? server->connection_memory - SOCKLET_CHUNK_SIZE : 0);
+
+    add_client(client);
+
+    if (record->session[0])
+    {
+        char token[SOCKLET_SESSION_TOKEN_SIZE];
+        memcpy(token, record->session, sizeof(token));
+        token[sizeof(token) - 1] = '\0';
+        session_adopt(client, token, record->sequence);
+    }
+
+    const char *membership = payload + record->extra_length;
+    const char *end = membership + record->memberships_length;
+    while (membership < end)
+    {
+        size_t entry = strnlen(membership, end - membership);
+        if (membership + entry == end)
+            break;
+        if (membership[0] == 'r')
+            room_join(client, membership + 1);
+        else if (membership[0] == 't')
+            topic_subscribe(client, membership + 1);
+        membership += entry + 1;
+    }
+
+    atomic_fetch_add(&active_connections, 1);
+    if (loop_enqueue(loop_for_connection(server, fd), fd, client) != 0)
+    {
+        atomic_fetch_sub(&active_connections, 1);
+        client_remove(client);
+        return -1;
+    }
+    return 0;
+}
+
+typedef struct
+{
+    server_t *server;
+    int connection;
+} handoff_receiver_t;
+
+static void *handoff_receive_thread(void *arg)
+{
+    handoff_receiver_t *receiver = (handoff_receiver_t *)arg;
+    char *buffer = malloc(SOCKLET_HANDOFF_RECORD_SIZE);
+    int adopted = 0;
+
+    while (buffer)
+    {
+        int fd;
+        ssize_t length = handoff_recv(receiver->connection, buffer, SOCKLET_HANDOFF_RECORD_SIZE, &fd);
+        handoff_record_t record;
+
+        if (length < (ssize_t)sizeof(record))
+        {
+            if (fd >= 0)
+                close(fd);
+            break;
+        }
+        memcpy(&record, buffer, sizeof(record));
+
+        if (record.magic != SOCKLET_HANDOFF_MAGIC || record.kind == SOCKLET_HANDOFF_END)
+        {
+            if (fd >= 0)
+                close(fd);
+            break;
+        }
+
+        if (record.kind == SOCKLET_HANDOFF_CLIENT && fd >= 0)
+        {
+            if (handoff_adopt(receiver->server, &record, buffer + sizeof(record), length - sizeof(record), fd) == 0)
+                adopted++;
+        }
+        else if (fd >= 0)
+        {
+            close(fd);
+        }
+    }
+
+    printf("Adopted %d connections\n", adopted);
+    close(receiver->connection);
+    free(buffer);
+    free(receiver);
+    return NULL;
+}
+
+// Connections keep arriving while the old process drains, so the listener is
+// taken over right away and the remaining records are read on a thread.
+static int handoff_receive(server_t *server)
+{
+    struct sockaddr_un address;
+    if (handoff_address(server->handoff_path, &address) != 0)
+        return -1;
+
+    int connection = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (connection < 0 || connect(connection, (struct sockaddr *)&address, sizeof(address)) != 0)
+    {
+        if (connection >= 0)
+            close(connection);
+        return -1;
+    }
+
+    handoff_record_t record;
+    int fd;
+    ssize_t length = handoff_recv(connection, (char *)&record, sizeof(record), &fd);
+    if (length != sizeof(record) || record.magic != SOCKLET_HANDOFF_MAGIC || record.kind != SOCKLET_HANDOFF_LISTENER || fd < 0)
+    {
+        fprintf(stderr, "Handoff from %s failed\n", server->handoff_path);
+        if (fd >= 0)
+            close(fd);
+        close(connection);
+        return -1;
+    }
+    server->server_fd = fd;
+
+    handoff_receiver_t *receiver = malloc(sizeof(handoff_receiver_t));
+    pthread_t thread_id;
+    if (receiver)
+    {
+        receiver->server = server;
+        receiver->connection = connection;
+    }
+    if (!receiver || pthread_create(&thread_id, NULL, handoff_receive_thread, receiver) != 0)
+    {
+        perror("Failed to start handoff receiver");
+        free(receiver);
+        close(connection);
+        return 0;
+    }
+    pthread_detach(thread_id);
+    return 0;
+}
+
+
+// Rate limits use the generic cell rate algorithm: a token bucket of `burst`
+// tokens refilled at `rate` per second, kept as one theoretical arrival time.
+static void rate_limit_init(rate_limit_t *limit, double rate, uint32_t burst, int action)
+{
+    limit->interval_ns = rate > 0 ? (uint64_t)(1e9 / rate) : 0;
+    limit->tolerance_ns = limit->interval_ns * (burst > 0 ? burst - 1 : 0);
+    limit->action = action;
+}
+
+void server_set_rate_limit(server_t *server, double rate, uint32_t burst, int action)
+{
+    rate_limit_init(&server->rate_limit, rate, burst, action);
+}
+
+int event_set_rate_limit(const char *event_name, double rate, uint32_t burst, int action)
+{
+    event_t *event = event_lookup(event_name, strlen(event_name));
+    if (!event)
+    {
+        fprintf(stderr, "Cannot limit unregistered event %s\n", event_name);
+        return -1;
+    }
+
+    if (event->limit_slot < 0)
+    {
+        if (limited_event_count == SOCKLET_LIMITED_EVENTS)
+        {
+            fprintf(stderr, "No rate limit slot left for %s\n", event_name);
+            return -1;
+        }
+        event->limit_slot = limited_event_count++;
+    }
+
+    rate_limit_init(&event->limit, rate, burst, action);
+    return 0;
+}
+
+void rate_limit_stats(rate_limit_stats_t *stats)
+{
+    stats->dropped = atomic_load_explicit(&shed_counters[SOCKLET_LIMIT_DROP], memory_order_relaxed);
+    stats->delayed = atomic_load_explicit(&shed_counters[SOCKLET_LIMIT_DELAY], memory_order_relaxed);
+    stats->disconnected = atomic_load_explicit(&shed_counters[SOCKLET_LIMIT_DISCONNECT], memory_order_relaxed);
+    stats->shed_bytes = atomic_load_explicit(&shed_counters[3], memory_order_relaxed);
+}
+
+static uint64_t monotonic_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+// Returns 0 when the bucket had a token, otherwise how long until it has one.
+static uint64_t rate_limit_take(uint64_t *tat, const rate_limit_t *limit, uint64_t now)
+{
+    uint64_t arrival = *tat > now ? *tat : now;
+    if (arrival - now > limit->tolerance_ns)
+        return arrival - now - limit->tolerance_ns;
+
+    *tat = arrival + limit->interval_ns;
+    return 0;
+}
+
+static int rate_limit_apply(client_t *client, uint64_t *tat, const rate_limit_t *limit, size_t length, uint64_t *now)
+{
+    uint64_t wait = rate_limit_take(tat, limit, *now);
+    if (!wait)
+        return 0;
+
+    if (limit->action == SOCKLET_LIMIT_DELAY)
+    {
+        // A retried message is only counted the first time it is held.
+        if (!client->held)
+        {
+            client->shed++;
+            atomic_fetch_add_explicit(&shed_counters[SOCKLET_LIMIT_DELAY], 1, memory_order_relaxed);
+        }
+        client->resume_at = *now + wait;
+        return 2;
+    }
+
+    client->shed++;
+    atomic_fetch_add_explicit(&shed_counters[limit->action], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&shed_counters[3], length, memory_order_relaxed);
+    return limit->action == SOCKLET_LIMIT_DROP ? 1 : -1;
+}
+
+// Returns 0 to deliver, 1 to drop, 2 to hold until client->resume_at and
+// -1 to disconnect. rate_stage remembers that a held message has already
+// passed the server-wide bucket, so a retry does not charge it twice.
+static int rate_limit_check(client_t *client, size_t length)
+{
+    const rate_limit_t *limit = &client->server->rate_limit;
+    if (client->rate_stage != 0 || !limit->interval_ns)
+        return 0;
+
+    uint64_t now = monotonic_ns();
+    return rate_limit_apply(client, &client->rate_tat, limit, length, &now);
+}
+
+static int rate_limit_check_event(client_t *client, const dispatch_envelope_t *envelope, size_t length)
+{
+    int verdict = 0;
+
+    if (limited_event_count > 0 && strcmp(envelope->type, "socklet:dispatch") == 0)
+    {
+        event_t *event = event_lookup(envelope->event, strlen(envelope->event));
+        if (event && event->limit_slot >= 0 && event->limit.interval_ns)
+        {
+            uint64_t now = monotonic_ns();
+            verdict = rate_limit_apply(client, &client->event_tat[event->limit_slot], &event->limit, length, &now);
+        }
+    }
+
+    client->rate_stage = verdict == 2;
+    return verdict;
+}
+
+
+// Connections are served by a small set of epoll loops instead of a thread
+// each. An idle connection owns only its client_t and session: the receive
+// buffer belongs to the loop, and handshake and message buffers are leased
+// from the loop's pool while bytes are in flight.
+
+static void *pool_lease(buffer_pool_t *pool)
+{
+    if (pool && pool->free)
+    {
+        pool_block_t *block = pool->free;
+        pool->free = block->next;
+        pool->cached--;
+        return block;
+    }
+    return malloc(SOCKLET_POOL_BLOCK_SIZE);
+}
+
+static void pool_return(buffer_pool_t *pool, void *buffer)
+{
+    if (!buffer)
+        return;
+
+    if (!pool || pool->cached >= SOCKLET_POOL_CACHED)
+    {
+        free(buffer);
+        return;
+    }
+
+    pool_block_t *block = (pool_block_t *)buffer;
+    block->next = pool->free;
+    pool->free = block;
+    pool->cached++;
+}
+
+static void loop_watch(event_loop_t *loop, client_t *client, uint32_t events, int operation)
+{
+    struct epoll_event event = {0};
+    event.events = events;
+    event.data.ptr = client;
+    if (epoll_ctl(loop->epoll_fd, operation, client->client_fd, &event) != 0 && operation != EPOLL_CTL_DEL)
+        perror("epoll_ctl");
+}
+
+static bool client_idle(client_t *client)
+{
+    if (client->state != SOCKLET_CLIENT_OPEN || client->held || client->pending || frame_reader_wanted(&client->reader) != 0)
+        return false;
+
+    pthread_mutex_lock(&client->output_lock);
+    bool drained = client->output_length == 0;
+    pthread_mutex_unlock(&client->output_lock);
+    return drained;
+}
+
+// Open clients are polled for input unless the rate limiter holds them, and
+// for writability while they have output queued.
+static void loop_rearm(event_loop_t *loop, client_t *client, bool writing)
+{
+    client->writing = writing;
+    loop_watch(loop, client, (client->held ? 0 : EPOLLIN) | (writing ? EPOLLOUT : 0), EPOLL_CTL_MOD);
+}
+
+static void loop_unschedule(event_loop_t *loop, client_t *client)
+{
+    for (client_t **link = &loop->timers; *link; link = &(*link)->timer_next)
+    {
+        if (*link == client)
+        {
+            *link = client->timer_next;
+            break;
+        }
+    }
+    client->timer_next = NULL;
+}
+
+static void loop_schedule(event_loop_t *loop, client_t *client)
+{
+    client_t **link = &loop->timers;
+    while (*link && (*link)->resume_at <= client->resume_at)
+    {
+        link = &(*link)->timer_next;
+    }
+    client->timer_next = *link;
+    *link = client;
+}
+
+// Each loop links its own clients: open ones at the head and handshaking
+// ones at the tail in arrival order, starting at loop->handshakes. With a
+// fixed timeout, handshake deadlines then expire from loop->handshakes on.
+static void loop_attach(event_loop_t *loop, client_t *client)
+{
+    client->loop_prev = NULL;
+    client->loop_next = NULL;
+    if (client->state == SOCKLET_CLIENT_HANDSHAKE)
+    {
+        client->resume_at = monotonic_ns() + (uint64_t)SOCKLET_HANDSHAKE_TIMEOUT_MS * 1000000;
+        client->loop_prev = loop->clients_tail;
+        if (loop->clients_tail)
+            loop->clients_tail->loop_next = client;
+        else
+            loop->clients = client;
+        loop->clients_tail = client;
+        if (!loop->handshakes)
+            loop->handshakes = client;
+    }
+    else
+    {
+        client->loop_next = loop->clients;
+        if (loop->clients)
+            loop->clients->loop_prev = client;
+        else
+            loop->clients_tail = client;
+        loop->clients = client;
+    }
+}
+
+static void loop_detach(event_loop_t *loop, client_t *client)
+{
+    if (loop->handshakes == client)
+        loop->handshakes = client->loop_next;
+    if (client->loop_prev)
+        client->loop_prev->loop_next = client->loop_next;
+    else
+        loop->clients = client->loop_next;
+    if (client->loop_next)
+        client->loop_next->loop_prev = client->loop_prev;
+    else
+        loop->clients_tail = client->loop_prev;
+    client->loop_prev = NULL;
+    client->loop_next = NULL;
+}
+
+static void loop_forget(event_loop_t *loop, client_t *client)
+{
+    // Handed-off descriptors stay open in the next process, so the epoll
+    // registration has to be removed explicitly rather than by close().
+    loop_watch(loop, client, 0, EPOLL_CTL_DEL);
+    loop_detach(loop, client);
+    if (client->held)
+        loop_unschedule(loop, client);
+    if (client->cpu >= 0)
+        atomic_fetch_sub_explicit(&cpu_counters[client->cpu].connections, 1, memory_order_relaxed);
+    atomic_fetch_sub(&active_connections, 1);
+}
+
+static void loop_close(event_loop_t *loop, client_t *client, uint16_t code)
+{
+    loop_forget(loop, client);
+
+    if (client->state == SOCKLET_CLIENT_HANDSHAKE)
+    {
+        close(client->client_fd);
+        pool_return(&loop->pool, client->request);
+        free(client->pending);
+        free(client);
+        return;
+    }
+
+    // Whatever the socket still takes of the queue goes out ahead of the
+    // close frame; the rest is dropped with the connection.
+    if (code)
+        send_close_frame(client->client_fd, code);
+    client_flush(client);
+
+    if (loop->server->recorder)
+        trace_record(loop->server->recorder, client->id, SOCKLET_TRACE_CLOSE, NULL, 0);
+
+    frame_reader_release(client);
+    client_remove(client);
+}
+
+// Returns -1 once the client has been closed.
+static int loop_write(event_loop_t *loop, client_t *client)
+{
+    ssize_t queued = client_flush(client);
+    if (queued < 0)
+    {
+        loop_close(loop, client, 0);
+        return -1;
+    }
+    if ((queued > 0) != client->writing)
+        loop_rearm(loop, client, queued > 0);
+    return 0;
+}
+
+static void loop_take_flushes(event_loop_t *loop)
+{
+    pthread_mutex_lock(&loop->lock);
+    client_t *client = loop->flushes;
+    loop->flushes = NULL;
+    pthread_mutex_unlock(&loop->lock);
+
+    while (client)
+    {
+        client_t *next = client->flush_next;
+        pthread_mutex_lock(&client->output_lock);
+        client->flush_posted = false;
+        pthread_mutex_unlock(&client->output_lock);
+        loop_write(loop, client);
+        client = next;
+    }
+}
+
+static void loop_handoff(event_loop_t *loop, client_t *client)
+{
+    loop_watch(loop, client, 0, EPOLL_CTL_DEL);
+    loop_detach(loop, client);
+    if (handoff_client(client) != 0)
+    {
+        // The client keeps its rooms and topics, and fan-out still reaches
+        // it, until a later drain pass retries or the deadline closes it.
+        // Its input stays in the socket for the next process, so only
+        // hangups and pending output are watched meanwhile.
+        loop_attach(loop, client);
+        if (monotonic_ms() >= atomic_load(&handoff_deadline))
+        {
+            loop_close(loop, client, SOCKLET_CLOSE_GOING_AWAY);
+            return;
+        }
+        loop_watch(loop, client, client->writing ? EPOLLOUT : 0, EPOLL_CTL_ADD);
+        return;
+    }
+
+    // handoff_client() has already released and freed the client.
+    if (loop->cpu >= 0)
+        atomic_fetch_sub_explicit(&cpu_counters[loop->cpu].connections, 1, memory_order_relaxed);
+    atomic_fetch_sub(&active_connections, 1);
+}
+
+static int loop_feed_pending(client_t *client)
+{
+    unsigned char *pending = client->pending;
+    size_t length = client->pending_length;
+
+    client->pending = NULL;
+    client->pending_length = 0;
+    int result = frame_reader_feed(client, pending, length);
+    free(pending);
+    return result;
+}
+
+static int loop_open(event_loop_t *loop, client_t *client)
+{
+    server_t *server = loop->server;
+    struct sockaddr_in client_address = client->client_address;
+    char *request = client->request;
+
+    // Frames pipelined behind the upgrade request are kept for the reader.
+    char *headers_end = strstr(request, "\r\n\r\n");
+    size_t extra = client->request_length - (headers_end + 4 - request);
+    if (extra > 0)
+    {
+        if (!(client->pending = malloc(extra)))
+            return -1;
+        memcpy(client->pending, headers_end + 4, extra);
+        client->pending_length = extra;
+    }
+
+    if (websocket_accept(client->client_fd, request) != 0)
+        return -1;
+
+    if (server->authentication_handler(client->client_fd, request))
+    {
+        printf("Authentication successful for %s:%d\n", inet_ntoa(client_address.sin_addr), ntohs(client_address.sin_port));
+    }
+    else
+    {
+        printf("Authentication failed for %s:%d\n", inet_ntoa(client_address.sin_addr), ntohs(client_address.sin_port));
+        return -1;
+    }
+
+    loop_detach(loop, client);
+    client->id = ((uint64_t)getpid() << 32) | (atomic_fetch_add(&client_id_counter, 1) + 1);
+    client->state = SOCKLET_CLIENT_OPEN;
+    client->resume_at = 0;
+    loop_attach(loop, client);
+    client->stream_handler = server->stream_handler;
+    frame_reader_init(&client->reader, server->connection_memory > SOCKLET_CHUNK_SIZE ? server->connection_memory - SOCKLET_CHUNK_SIZE : 0);
+    client->reader.pool = &loop->pool;
+
+    add_client(client);
+
+    session_create(client);
+
+    if (server->recorder)
+        trace_record(server->recorder, client->id, SOCKLET_TRACE_OPEN, NULL, 0);
+
+    server->callback(client->client_fd, request, client);
+
+    pool_return(&loop->pool, client->request);
+    client->request = NULL;
+    client->request_length = 0;
+
+    return client->pending ? loop_feed_pending(client) : 0;
+}
+
+static int loop_read_handshake(event_loop_t *loop, client_t *client)
+{
+    if (!client->request && !(client->request = pool_lease(&loop->pool)))
+        return -1;
+
+    ssize_t bytes_received = recv(client->client_fd, client->request + client->request_length,
+                                  SOCKLET_POOL_BLOCK_SIZE - 1 - client->request_length, MSG_DONTWAIT);
+    if (bytes_received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return 0;
+    if (bytes_received <= 0)
+    {
+        perror("Failed to receive handshake request");
+        return -1;
+    }
+
+    client->request_length += bytes_received;
+    client->request[client->request_length] = '\0';
+
+    if (!strstr(client->request, "\r\n\r\n"))
+    {
+        if (client->request_length < SOCKLET_POOL_BLOCK_SIZE - 1)
+            return 0;
+        printf("Failed to find the end of headers.\n");
+        return -1;
+    }
+
+    return loop_open(loop, client);
+}
+
+static int loop_read(event_loop_t *loop, client_t *client)
+{
+    size_t wanted = sizeof(loop->buffer);
+
+    // While handing off, finish the message in flight one frame at a time so
+    // whatever is still queued in the socket is left for the next process.
+    if (atomic_load(&handoff_draining))
+    {
+        size_t remaining = frame_reader_wanted(&client->reader);
+        if (remaining == 0)
+            return 0;
+        if (remaining < wanted)
+            wanted = remaining;
+    }
+
+    ssize_t bytes_received = recv(client->client_fd, loop->buffer, wanted, MSG_DONTWAIT);
+
+    if (bytes_received <= 0)
+    {
+        if (bytes_received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+            return 0;
+
+        if (bytes_received == 0)
+        {
+            printf("Client disconnected: %s:%d\n",
+                   inet_ntoa(client->client_address.sin_addr), ntohs(client->client_address.sin_port));
+        }
+        else
+        {
+            perror("recv failed");
+        }
+        return -1;
+    }
+
+    // An unpinned loop migrates between cores, so only pinned loops keep
+    // per-CPU counters and pay for the clock reads.
+    if (loop->cpu < 0)
+        return frame_reader_feed(client, loop->buffer, bytes_received);
+
+    uint64_t started = monotonic_ns();
+    int result = frame_reader_feed(client, loop->buffer, bytes_received);
+    cpu_account(loop->cpu, bytes_received, monotonic_ns() - started);
+    return result;
+}
+
+static void loop_settle(event_loop_t *loop, client_t *client, int result)
+{
+    if (result == 2)
+    {
+        // Held by the rate limiter: stop polling until the bucket refills.
+        loop_rearm(loop, client, client->writing);
+        loop_schedule(loop, client);
+        return;
+    }
+
+    if (result != 0)
+    {
+        loop_close(loop, client, 0);
+        return;
+    }
+
+    if (atomic_load(&handoff_draining) && client_idle(client))
+        loop_handoff(loop, client);
+}
+
+static void loop_run_timers(event_loop_t *loop)
+{
+    uint64_t now = monotonic_ns();
+
+    // A connection that has not finished its upgrade request in time gives
+    // its pool block back instead of holding it indefinitely.
+    while (loop->handshakes && loop->handshakes->resume_at <= now)
+    {
+        client_t *client = loop->handshakes;
+        printf("Handshake timed out for %s:%d\n", inet_ntoa(client->client_address.sin_addr), ntohs(client->client_address.sin_port));
+        loop_close(loop, client, 0);
+    }
+
+    while (loop->timers && loop->timers->resume_at <= now)
+    {
+        client_t *client = loop->timers;
+        loop->timers = client->timer_next;
+        client->timer_next = NULL;
+
+        int result = frame_reader_deliver(client);
+        if (result == 0 && client->pending)
+            result = loop_feed_pending(client);
+        if (result == 0)
+            loop_rearm(loop, client, client->writing);
+        loop_settle(loop, client, result);
+    }
+}
+
+static int loop_timeout(event_loop_t *loop)
+{
+    int timeout = -1;
+
+    if (loop->timers || loop->handshakes)
+    {
+        uint64_t now = monotonic_ns();
+        uint64_t resume_at = loop->timers ? loop->timers->resume_at : UINT64_MAX;
+        if (loop->handshakes && loop->handshakes->resume_at < resume_at)
+            resume_at = loop->handshakes->resume_at;
+        timeout = resume_at > now ? (int)((resume_at - now + 999999) / 1000000) : 0;
+    }
+
+    if (atomic_load(&handoff_draining) && (timeout < 0 || timeout > 50))
+        timeout = 50;
+    return timeout;
+}
+
+// Walks only this loop's own clients; open ones sit at the head of the list,
+// so the walk stops at the first handshaking client unless time is up.
+static void loop_drain(event_loop_t *loop)
+{
+    bool expired = monotonic_ms() >= atomic_load(&handoff_deadline);
+    client_t *next;
+
+    for (client_t *client = loop->clients; client && (expired || client != loop->handshakes); client = next)
+    {
+        next = client->loop_next;
+        if (client_idle(client))
+            loop_handoff(loop, client);
+        else if (expired)
+            loop_close(loop, client, client->state == SOCKLET_CLIENT_OPEN ? SOCKLET_CLOSE_GOING_AWAY : 0);
+    }
+}
+
+static void loop_take_queue(event_loop_t *loop)
+{
+    uint64_t value;
+    if (read(loop->wake_fd, &value, sizeof(value)) < 0 && errno != EAGAIN)
+        perror("loop wake");
+
+    pthread_mutex_lock(&loop->lock);
+    loop_entry_t *queue = loop->queue;
+    size_t count = loop->queue_count;
+    loop->queue = NULL;
+    loop->queue_count = 0;
+    loop->queue_capacity = 0;
+    pthread_mutex_unlock(&loop->lock);
+
+    for (size_t i = 0; i < count; i++)
+    {
+        client_t *client = queue[i].client;
+
+        // New connections are allocated here, after the loop is pinned, so
+        // their state is first touched on the loop's NUMA node.
+        if (!client)
+        {
+            client = calloc(1, sizeof(client_t));
+            if (!client)
+            {
+                perror("Failed to allocate memory for client");
+                close(queue[i].fd);
+                atomic_fetch_sub(&active_connections, 1);
+                continue;
+            }
+            client->client_fd = queue[i].fd;
+            client->server = loop->server;
+            client->state = SOCKLET_CLIENT_HANDSHAKE;
+            socklen_t client_len = sizeof(client->client_address);
+            getpeername(client->client_fd, (struct sockaddr *)&client->client_address, &client_len);
+            printf("Handling client %s:%d\n", inet_ntoa(client->client_address.sin_addr), ntohs(client->client_address.sin_port));
+        }
+
+        // An adopted client may already have output queued for it.
+        bool queued = false;
+        if (client->state == SOCKLET_CLIENT_OPEN)
+        {
+            pthread_mutex_lock(&client->output_lock);
+            client->loop = loop;
+            queued = client->output_length > 0;
+            pthread_mutex_unlock(&client->output_lock);
+        }
+        client->loop = loop;
+        client->cpu = loop->cpu;
+        client->reader.pool = &loop->pool;
+        loop_attach(loop, client);
+        if (loop->cpu >= 0)
+        {
+            atomic_fetch_add_explicit(&cpu_counters[loop->cpu].connections, 1, memory_order_relaxed);
+            atomic_store_explicit(&cpu_counters[loop->cpu].seen, true, memory_order_relaxed);
+        }
+        client->writing = queued;
+        loop_watch(loop, client, EPOLLIN | (queued ? EPOLLOUT : 0), EPOLL_CTL_ADD);
+    }
+    free(queue);
+}
+
+static void *loop_thread(void *arg)
+{
+    event_loop_t *loop = (event_loop_t *)arg;
+    struct epoll_event events[SOCKLET_LOOP_EVENTS];
+
+    if (loop->cpu >= 0)
+        cpu_pin(loop->cpu);
+    loop_current = loop;
+
+    while (1)
+    {
+        int count = epoll_wait(loop->epoll_fd, events, SOCKLET_LOOP_EVENTS, loop_timeout(loop));
+        if (count < 0 && errno != EINTR)
+            perror("epoll_wait");
+
+        for (int i = 0; i < count; i++)
+        {
+            client_t *client = (client_t *)events[i].data.ptr;
+            if (!client)
+            {
+                loop_take_queue(loop);
+                continue;
+            }
+
+            if ((events[i].events & EPOLLOUT) && loop_write(loop, client) != 0)
+                continue;
+
+            // A held client is only polled for hangups; its timer resumes it.
+            if (client->held)
+            {
+                if (events[i].events & (EPOLLHUP | EPOLLERR))
+                    loop_close(loop, client, 0);
+                continue;
+            }
+
+            if (!(events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+                continue;
+
+            if (client->state == SOCKLET_CLIENT_HANDSHAKE)
+                loop_settle(loop, client, loop_read_handshake(loop, client));
+            else
+                loop_settle(loop, client, loop_read(loop, client));
+        }
+
+        loop_run_timers(loop);
+        loop_take_flushes(loop);
+
+        if (atomic_load(&handoff_draining))
+            loop_drain(loop);
+    }
+    return NULL;
+}
+
+static int loop_enqueue(event_loop_t *loop, int fd, client_t *client)
+{
+    pthread_mutex_lock(&loop->lock);
+    if (loop->queue_count == loop->queue_capacity)
+    {
+        size_t capacity = loop->queue_capacity ? loop->queue_capacity * 2 : 16;
+        loop_entry_t *queue = realloc(loop->queue, sizeof(loop_entry_t) * capacity);
+        if (!queue)
+        {
+            pthread_mutex_unlock(&loop->lock);
+            perror("Failed to queue connection");
+            return -1;
+        }
+        loop->queue = queue;
+        loop->queue_capacity = capacity;
+    }
+    loop->queue[loop->queue_count++] = (loop_entry_t){fd, client};
+    pthread_mutex_unlock(&loop->lock);
+
+    uint64_t wake = 1;
+    if (write(loop->wake_fd, &wake, sizeof(wake)) != sizeof(wake))
+        perror("loop wake");
+    return 0;
+}
+
+// Prefers the loop running on the core whose softirq delivered the
+// connection, when SO_INCOMING_CPU steering is on.
+static event_loop_t *loop_for_connection(server_t *server, int client_fd)
+{
+    if (server->steer_incoming_cpu)
+    {
+        int incoming;
+        socklen_t length = sizeof(incoming);
+        if (getsockopt(client_fd, SOL_SOCKET, SO_INCOMING_CPU, &incoming, &length) == 0)
+        {
+            for (size_t i = 0; i < server->loop_count; i++)
+            {
+                if (server->loops[i]->cpu == incoming)
+                    return server->loops[i];
+            }
+        }
+    }
+
+    return server->loops[atomic_fetch_add(&server->next_loop, 1) % server->loop_count];
+}
+
+static void server_start_loops(server_t *server)
+{
+    if (server->loops)
+        return;
+
+    size_t count = server->cpu_count ? server->cpu_count : server->loop_count;
+    if (count == 0)
+    {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        count = online > 0 ? (size_t)online : 1;
+    }
+
+    server->loops = calloc(count, sizeof(event_loop_t *));
+    if (!server->loops)
+    {
+        perror("Failed to allocate event loops");
+        exit(EXIT_FAILURE);
+    }
+
+    // Maps descriptors to clients for the fd-based send functions. Sized
+    // once, before any client exists; untouched entries cost no memory.
+    if (!fd_clients)
+    {
+        struct rlimit limit;
+        rlim_t capacity = getrlimit(RLIMIT_NOFILE, &limit) == 0 ? limit.rlim_cur : 1024;
+        if (capacity > (1 << 22))
+            capacity = 1 << 22;
+        fd_clients = calloc(capacity, sizeof(*fd_clients));
+        fd_capacity = fd_clients ? (int)capacity : 0;
+    }
+    atomic_store(&loops_running, true);
+
+    for (size_t i = 0; i < count; i++)
+    {
+        // malloc rather than calloc: the receive buffer is first touched by
+        // the loop thread itself once it has been pinned.
+        event_loop_t *loop = malloc(sizeof(event_loop_t));
+        if (!loop)
+        {
+            perror("Failed to allocate event loop");
+            exit(EXIT_FAILURE);
+        }
+
+        loop->cpu = server->cpu_count ? server->cpus[i] : -1;
+        loop->server = server;
+        pthread_mutex_init(&loop->lock, NULL);
+        loop->queue = NULL;
+        loop->queue_count = 0;
+        loop->queue_capacity = 0;
+        loop->pool.free = NULL;
+        loop->pool.cached = 0;
+        loop->timers = NULL;
+        loop->clients = NULL;
+        loop->clients_tail = NULL;
+        loop->handshakes = NULL;
+        loop->flushes = NULL;
+        loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        loop->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+
+        struct epoll_event event = {0};
+        event.events = EPOLLIN;
+        event.data.ptr = NULL;
+
+        pthread_t thread_id;
+        if (loop->epoll_fd < 0 || loop->wake_fd < 0 ||
+            epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->wake_fd, &event) != 0 ||
+            pthread_create(&thread_id, NULL, loop_thread, loop) != 0)
+        {
+            perror("Failed to start event loop");
+            exit(EXIT_FAILURE);
+        }
+        pthread_detach(thread_id);
+        server->loops[i] = loop;
+    }
+
+    server->loop_count = count;
+    printf("Started %zu event loops\n", count);
+}
+
+
+static int64_t realtime_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (int64_t)now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+// Appends to the log at `path`, creating it if needed. Timestamps are taken
+// from the existing header, so a process started by a hot restart continues
+// the same timeline and writes whole records behind the old one.
+int server_set_recorder(server_t *server, const char *path)
+{
+    trace_recorder_t *recorder = calloc(1, sizeof(trace_recorder_t));
+    if (!recorder)
+    {
+        perror("Failed to allocate recorder");
+        return -1;
+    }
+
+    recorder->fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (recorder->fd < 0)
+    {
+        perror("Failed to open traffic log");
+        free(recorder);
+        return -1;
+    }
+
+    trace_header_t header;
+    ssize_t read_bytes = pread(recorder->fd, &header, sizeof(header), 0);
+    if (read_bytes == 0)
+    {
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, SOCKLET_TRACE_MAGIC, sizeof(header.magic));
+        header.version = SOCKLET_TRACE_VERSION;
+        header.record_size = sizeof(trace_record_t);
+        header.epoch_ns = realtime_ns();
+        if (write(recorder->fd, &header, sizeof(header)) != sizeof(header))
+            read_bytes = -1;
+        else
+            read_bytes = sizeof(header);
+    }
+
+    if (read_bytes != sizeof(header) || memcmp(header.magic, SOCKLET_TRACE_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != SOCKLET_TRACE_VERSION)
+    {
+        fprintf(stderr, "%s is not a socklet traffic log\n", path);
+        close(recorder->fd);
+        free(recorder);
+        return -1;
+    }
+
+    recorder->epoch_ns = header.epoch_ns;
+    pthread_mutex_init(&recorder->lock, NULL);
+    pthread_condattr_t attributes;
+    pthread_condattr_init(&attributes);
+    pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+    pthread_cond_init(&recorder->wake, &attributes);
+    pthread_condattr_destroy(&attributes);
+    pthread_cond_init(&recorder->flushed, NULL);
+
+    pthread_t writer;
+    if (pthread_create(&writer, NULL, trace_writer, recorder) != 0)
+    {
+        perror("Failed to start traffic log writer");
+        close(recorder->fd);
+        free(recorder);
+        return -1;
+    }
+    pthread_detach(writer);
+    server->recorder = recorder;
+    return 0;
+}
+
+// Writes one buffer of whole records. If the disk fills up part way, the
+// partial tail is cut off again so the log still ends on a record boundary,
+// and recording stops.
+static void trace_write(trace_recorder_t *recorder, const unsigned char *data, size_t length)
+{
+    size_t written = 0;
+    while (written < length)
+    {
+        ssize_t result = write(recorder->fd, data + written, length - written);
+        if (result < 0 && errno == EINTR)
+            continue;
+        if (result <= 0)
+        {
+            perror("Failed to write traffic log");
+            off_t end = lseek(recorder->fd, 0, SEEK_END);
+            if (written > 0 && (end < (off_t)written || ftruncate(recorder->fd, end - (off_t)written) != 0))
+                perror("Failed to truncate traffic log");
+            fprintf(stderr, "Traffic recording stopped\n");
+            atomic_store(&recorder->failed, true);
+            return;
+        }
+        written += result;
+    }
+}
+
+// Takes whatever a thread has buffered, handing it the previous (already
+// written) buffer in exchange, and writes it out without holding any lock.
+static void trace_write_buffer(trace_recorder_t *recorder, trace_buffer_t *buffer)
+{
+    pthread_mutex_lock(&buffer->lock);
+    if (buffer->length == 0)
+    {
+        pthread_mutex_unlock(&buffer->lock);
+        return;
+    }
+
+    unsigned char *data = buffer->data;
+    size_t length = buffer->length;
+    size_t capacity = buffer->capacity;
+    buffer->data = buffer->spare;
+    buffer->capacity = buffer->spare_capacity;
+    buffer->length = 0;
+    buffer->spare = data;
+    buffer->spare_capacity = capacity;
+    pthread_cond_broadcast(&buffer->swapped);
+    pthread_mutex_unlock(&buffer->lock);
+
+    if (!atomic_load(&recorder->failed))
+        trace_write(recorder, data, length);
+}
+
+// Every thread that records appends to its own buffer, so loops never share
+// a lock or wait on the disk. This thread collects the buffers every
+// SOCKLET_TRACE_FLUSH_MS, when one fills up, or when trace_flush() asks.
+static void *trace_writer(void *arg)
+{
+    trace_recorder_t *recorder = arg;
+
+    pthread_mutex_lock(&recorder->lock);
+    while (1)
+    {
+        if (recorder->flush_completed == recorder->flush_requested)
+        {
+            struct timespec until;
+            clock_gettime(CLOCK_MONOTONIC, &until);
+            until.tv_nsec += (long)SOCKLET_TRACE_FLUSH_MS * 1000000L;
+            until.tv_sec += until.tv_nsec / 1000000000L;
+            until.tv_nsec %= 1000000000L;
+            pthread_cond_timedwait(&recorder->wake, &recorder->lock, &until);
+        }
+
+        // Buffers are only ever pushed onto the head and never freed.
+        uint64_t request = recorder->flush_requested;
+        trace_buffer_t *buffers = recorder->buffers;
+        pthread_mutex_unlock(&recorder->lock);
+
+        for (trace_buffer_t *buffer = buffers; buffer; buffer = buffer->next)
+        {
+            trace_write_buffer(recorder, buffer);
+        }
+
+        pthread_mutex_lock(&recorder->lock);
+        recorder->flush_completed = request;
+        pthread_cond_broadcast(&recorder->flushed);
+    }
+    return NULL;
+}
+
+static void trace_wake(trace_recorder_t *recorder)
+{
+    pthread_mutex_lock(&recorder->lock);
+    pthread_cond_signal(&recorder->wake);
+    pthread_mutex_unlock(&recorder->lock);
+}
+
+// Waits until everything recorded before the call is in the file.
+void trace_flush(trace_recorder_t *recorder)
+{
+    if (!recorder)
+        return;
+
+    pthread_mutex_lock(&recorder->lock);
+    uint64_t request = ++recorder->flush_requested;
+    pthread_cond_signal(&recorder->wake);
+    while (recorder->flush_completed < request)
+    {
+        pthread_cond_wait(&recorder->flushed, &recorder->lock);
+    }
+    pthread_mutex_unlock(&recorder->lock);
+}
+
+static _Thread_local trace_buffer_t *trace_local = NULL;
+
+static trace_buffer_t *trace_buffer(trace_recorder_t *recorder)
+{
+    if (trace_local && trace_local->recorder == recorder)
+        return trace_local;
+
+    pthread_mutex_lock(&recorder->lock);
+    trace_buffer_t *buffer = recorder->buffers;
+    while (buffer && !pthread_equal(buffer->owner, pthread_self()))
+        buffer = buffer->next;
+
+    if (!buffer && (buffer = calloc(1, sizeof(trace_buffer_t))))
+    {
+        buffer->recorder = recorder;
+        buffer->owner = pthread_self();
+        pthread_mutex_init(&buffer->lock, NULL);
+        pthread_cond_init(&buffer->swapped, NULL);
+        buffer->next = recorder->buffers;
+        recorder->buffers = buffer;
+    }
+    pthread_mutex_unlock(&recorder->lock);
+
+    if (buffer)
+        trace_local = buffer;
+    else
+        perror("Failed to allocate trace buffer");
+    return buffer;
+}
+
+void trace_record(trace_recorder_t *recorder, uint64_t connection, uint8_t kind, const void *data, size_t length)
+{
+    size_t padded = SOCKLET_TRACE_ALIGN(length);
+    size_t size = sizeof(trace_record_t) + padded;
+
+    if (length > UINT32_MAX || atomic_load_explicit(&recorder->failed, memory_order_relaxed))
+        return;
+
+    trace_buffer_t *buffer = trace_buffer(recorder);
+    if (!buffer)
+        return;
+
+    pthread_mutex_lock(&buffer->lock);
+
+    // A full buffer waits for the writer to swap it out, which it does
+    // without touching the disk while holding the lock.
+    while (buffer->length > 0 && buffer->length + size > buffer->capacity && !atomic_load(&recorder->failed))
+    {
+        trace_wake(recorder);
+        pthread_cond_wait(&buffer->swapped, &buffer->lock);
+    }
+
+    if (size > buffer->capacity && !atomic_load(&recorder->failed))
+    {
+        size_t capacity = size > SOCKLET_TRACE_BUFFER_SIZE ? size : SOCKLET_TRACE_BUFFER_SIZE;
+        unsigned char *grown = realloc(buffer->data, capacity);
+        if (grown)
+        {
+            buffer->data = grown;
+            buffer->capacity = capacity;
+        }
+        else
+        {
+            perror("Failed to allocate trace buffer");
+        }
+    }
+
+    if (size > buffer->capacity - buffer->length || atomic_load(&recorder->failed))
+    {
+        pthread_mutex_unlock(&buffer->lock);
+        return;
+    }
+
+    // Records are stamped per thread; readers that need one timeline sort
+    // them by timestamp, since buffers from different loops interleave.
+    trace_record_t record = {0};
+    record.timestamp_ns = (uint64_t)(realtime_ns() - recorder->epoch_ns);
+    record.connection = connection;
+    record.length = (uint32_t)length;
+    record.kind = kind;
+
+    unsigned char *out = buffer->data + buffer->length;
+    memcpy(out, &record, sizeof(record));
+    if (length > 0)
+        memcpy(out + sizeof(record), data, length);
+    memset(out + sizeof(record) + length, 0, padded - length);
+    buffer->length += size;
+
+    pthread_mutex_unlock(&buffer->lock);
+}
+
+// Walks a mapped log. Pass *offset = 0 to start; returns NULL at the end, at
+// a truncated record, or if the header does not match this version.
+const trace_record_t *trace_next(const unsigned char *log, size_t log_size, size_t *offset)
+{
+    if (*offset == 0)
+    {
+        const trace_header_t *header = (const trace_header_t *)log;
+        if (log_size < sizeof(*header) || memcmp(header->magic, SOCKLET_TRACE_MAGIC, sizeof(header->magic)) != 0 ||
+            header->version != SOCKLET_TRACE_VERSION || header->record_size != sizeof(trace_record_t))
+            return NULL;
+        *offset = sizeof(*header);
+    }
+
+    if (log_size - *offset < sizeof(trace_record_t))
+        return NULL;
+
+    const trace_record_t *record = (const trace_record_t *)(log + *offset);
+    size_t size = sizeof(*record) + SOCKLET_TRACE_ALIGN((size_t)record->length);
+    if (log_size - *offset < size)
+        return NULL;
+
+    *offset += size;
+    return record;
+}
+
 #endif
 
 #endif